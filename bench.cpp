@@ -0,0 +1,340 @@
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "heap.hpp"
+
+// Microbenchmarks of this heap, side by side with glibc malloc. Each one
+// is run with both allocators; latencies include the timer overhead (the
+// same for both). STL containers use the allocator through WithAllocator,
+// because operator new is replaced by this heap (by default).
+//
+// Usage: heap_bench [scale] (scale multiplies the iteration counts)
+
+struct GlibcMalloc
+{
+    static constexpr char const* name = "glibc";
+    static void* alloc(size_t size) { return malloc(size); }
+    static void free(void* addr) { ::free(addr); }
+};
+
+struct MyHeap
+{
+    static constexpr char const* name = "heap";
+    static void* alloc(size_t size) { return my_malloc(size); }
+    static void free(void* addr) { my_free(addr); }
+};
+
+template<class T, class A>
+struct WithAllocator
+{
+    using value_type = T;
+
+    WithAllocator() = default;
+    template<class U>
+    WithAllocator(WithAllocator<U, A> const&) {}
+
+    T* allocate(size_t count) { return static_cast<T*>(A::alloc(count * sizeof(T))); }
+    void deallocate(T* addr, size_t) { A::free(addr); }
+
+    template<class U>
+    struct rebind { using other = WithAllocator<U, A>; };
+
+    bool operator==(WithAllocator const&) const { return true; }
+    bool operator!=(WithAllocator const&) const { return false; }
+};
+
+using Clock = std::chrono::steady_clock;
+
+double elapsed_ns(Clock::time_point start, Clock::time_point end)
+{
+    return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+// Timings of single operations
+class Latencies
+{
+public:
+    explicit Latencies(size_t capacity) { m_samples.reserve(capacity); }
+
+    template<class F>
+    void time(F&& op)
+    {
+        auto start = Clock::now();
+        op();
+        m_samples.push_back(elapsed_ns(start, Clock::now()));
+    }
+
+    void append(Latencies const& other)
+    {
+        m_samples.insert(m_samples.end(), other.m_samples.begin(), other.m_samples.end());
+    }
+
+    size_t count() const { return m_samples.size(); }
+
+    double percentile(double p)
+    {
+        if(m_samples.empty())
+            return 0;
+        size_t index = std::min(m_samples.size() - 1, (size_t)(p / 100 * m_samples.size()));
+        std::nth_element(m_samples.begin(), m_samples.begin() + index, m_samples.end());
+        return m_samples[index];
+    }
+
+private:
+    std::vector<double> m_samples;
+};
+
+void report(char const* bench, char const* allocator, size_t ops, double total_ns, Latencies& latencies)
+{
+    printf("%-18s %-6s %12.0f", bench, allocator, ops / (total_ns / 1e9));
+    if(latencies.count())
+        printf(" %9.0f %9.0f %9.0f\n", latencies.percentile(50), latencies.percentile(99), latencies.percentile(99.9));
+    else
+        printf(" %9s %9s %9s\n", "-", "-", "-");
+}
+
+// Keeps a window of live objects, replacing one of them per operation
+template<class A>
+void small_churn(size_t scale)
+{
+    constexpr size_t window = 1024;
+    size_t ops = 2000000 * scale;
+    void* slots[window] {};
+    Latencies latencies(ops);
+
+    auto start = Clock::now();
+    for(size_t i = 0; i < ops; i++)
+    {
+        auto& slot = slots[i * 7919 % window];
+        latencies.time([&] {
+            A::free(slot);
+            slot = A::alloc(32);
+        });
+        memset(slot, 0, 32);
+    }
+    auto end = Clock::now();
+    for(auto slot: slots)
+        A::free(slot);
+    report("small_churn", A::name, ops, elapsed_ns(start, end), latencies);
+}
+
+template<class A>
+void mixed_random(size_t scale)
+{
+    constexpr size_t window = 8192;
+    size_t ops = 1000000 * scale;
+    void* slots[window] {};
+    std::mt19937 random(42);
+    // Mostly small sizes, sometimes bigger ones
+    std::uniform_int_distribution<size_t> small(1, 512), medium(513, 8192), slot_index(0, window - 1);
+    Latencies latencies(ops);
+
+    auto start = Clock::now();
+    for(size_t i = 0; i < ops; i++)
+    {
+        auto& slot = slots[slot_index(random)];
+        size_t size = random() % 8 ? small(random) : medium(random);
+        latencies.time([&] {
+            A::free(slot);
+            slot = A::alloc(size);
+        });
+        *(char*)slot = 1;
+    }
+    auto end = Clock::now();
+    for(auto slot: slots)
+        A::free(slot);
+    report("mixed_random", A::name, ops, elapsed_ns(start, end), latencies);
+}
+
+// One operation is filling and destroying a whole vector
+template<class A>
+void vector_growth(size_t scale)
+{
+    size_t ops = 2000 * scale;
+    Latencies latencies(ops);
+
+    auto start = Clock::now();
+    for(size_t i = 0; i < ops; i++)
+    {
+        latencies.time([&] {
+            std::vector<int, WithAllocator<int, A>> vector;
+            for(int j = 0; j < 20000; j++)
+                vector.push_back(j);
+        });
+    }
+    report("vector_growth", A::name, ops, elapsed_ns(start, Clock::now()), latencies);
+}
+
+template<class A>
+void map_insert_erase(size_t scale)
+{
+    using Map = std::map<int, int, std::less<int>, WithAllocator<std::pair<int const, int>, A>>;
+    size_t ops = 1000000 * scale;
+    Map map;
+    std::mt19937 random(42);
+    Latencies latencies(ops);
+
+    auto start = Clock::now();
+    for(size_t i = 0; i < ops; i++)
+    {
+        int key = random() % 65536;
+        latencies.time([&] {
+            auto it = map.find(key);
+            if(it == map.end())
+                map.emplace(key, key);
+            else
+                map.erase(it);
+        });
+    }
+    auto end = Clock::now();
+    report("map_insert_erase", A::name, ops, elapsed_ns(start, end), latencies);
+}
+
+template<class A>
+void big_churn(size_t scale)
+{
+    constexpr size_t window = 16;
+    size_t ops = 20000 * scale;
+    void* slots[window] {};
+    std::mt19937 random(42);
+    std::uniform_int_distribution<size_t> size_of(64 << 10, 4 << 20);
+    Latencies latencies(ops);
+
+    auto start = Clock::now();
+    for(size_t i = 0; i < ops; i++)
+    {
+        auto& slot = slots[i % window];
+        size_t size = size_of(random);
+        latencies.time([&] {
+            A::free(slot);
+            slot = A::alloc(size);
+        });
+        // Touch the first and the last page
+        ((char*)slot)[0] = 1;
+        ((char*)slot)[size - 1] = 1;
+    }
+    auto end = Clock::now();
+    for(auto slot: slots)
+        A::free(slot);
+    report("big_churn", A::name, ops, elapsed_ns(start, end), latencies);
+}
+
+// Producers allocate, consumers free, so frees are mostly remote. Objects
+// are handed over in batches, so that the queue lock doesn't dominate. The
+// latencies are of the allocations.
+template<class A>
+void producer_consumer(size_t scale)
+{
+    constexpr size_t pairs = 4;
+    constexpr size_t batch_size = 256;
+    constexpr size_t queue_size = 16; // In batches
+    size_t batches_per_producer = 2000 * scale;
+
+    struct Batch
+    {
+        void* items[batch_size];
+    };
+    struct Queue
+    {
+        std::mutex lock;
+        Batch batches[queue_size];
+        size_t head = 0;
+        size_t tail = 0;
+    };
+    std::vector<Queue> queues(pairs);
+    std::vector<Latencies> latencies;
+    for(size_t i = 0; i < pairs; i++)
+        latencies.emplace_back(batches_per_producer * batch_size);
+
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for(size_t i = 0; i < pairs; i++)
+    {
+        threads.emplace_back([&, i] {
+            auto& queue = queues[i];
+            for(size_t j = 0; j < batches_per_producer; j++)
+            {
+                Batch batch;
+                for(size_t k = 0; k < batch_size; k++)
+                {
+                    latencies[i].time([&] { batch.items[k] = A::alloc(16 + k); });
+                    *(char*)batch.items[k] = 1;
+                }
+                while(true)
+                {
+                    {
+                        std::lock_guard guard(queue.lock);
+                        if(queue.tail - queue.head < queue_size)
+                        {
+                            queue.batches[queue.tail++ % queue_size] = batch;
+                            break;
+                        }
+                    }
+                    std::this_thread::yield();
+                }
+            }
+        });
+        threads.emplace_back([&, i] {
+            auto& queue = queues[i];
+            for(size_t j = 0; j < batches_per_producer;)
+            {
+                Batch batch;
+                bool taken = false;
+                {
+                    std::lock_guard guard(queue.lock);
+                    if(queue.head != queue.tail)
+                    {
+                        batch = queue.batches[queue.head++ % queue_size];
+                        taken = true;
+                    }
+                }
+                if(!taken)
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                for(auto addr: batch.items)
+                    A::free(addr);
+                j++;
+            }
+        });
+    }
+    for(auto& thread: threads)
+        thread.join();
+    auto end = Clock::now();
+
+    Latencies all(pairs * batches_per_producer * batch_size);
+    for(auto& thread_latencies: latencies)
+        all.append(thread_latencies);
+    report("producer_consumer", A::name, pairs * batches_per_producer * batch_size, elapsed_ns(start, end), all);
+}
+
+template<class A, class B, class F>
+void compare(F bench)
+{
+    bench.template operator()<A>();
+    bench.template operator()<B>();
+}
+
+int main(int argc, char** argv)
+{
+    size_t scale = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1;
+    if(!scale)
+        scale = 1;
+
+    printf("%-18s %-6s %12s %9s %9s %9s\n", "benchmark", "alloc", "ops/s", "p50 ns", "p99 ns", "p99.9 ns");
+    compare<GlibcMalloc, MyHeap>([&]<class A>() { small_churn<A>(scale); });
+    compare<GlibcMalloc, MyHeap>([&]<class A>() { mixed_random<A>(scale); });
+    compare<GlibcMalloc, MyHeap>([&]<class A>() { vector_growth<A>(scale); });
+    compare<GlibcMalloc, MyHeap>([&]<class A>() { map_insert_erase<A>(scale); });
+    compare<GlibcMalloc, MyHeap>([&]<class A>() { big_churn<A>(scale); });
+    compare<GlibcMalloc, MyHeap>([&]<class A>() { producer_consumer<A>(scale); });
+    return 0;
+}
@@ -1,15 +1,30 @@
 #include "heap.hpp"
 
 #include <assert.h>     // assert()
-#include <sys/mman.h>   // mmap(), munmap()
+#include <sys/mman.h>   // mmap(), munmap(), mremap(), madvise()
 #include <stdlib.h>     // abort()
 #include <stdio.h>      // printf(), perror()
-#include <string.h>     // memset()
+#include <string.h>     // memset(), memcpy()
+#include <pthread.h>    // pthread_mutex_lock(), pthread_key_create()
+#include <unistd.h>     // sysconf()
+#include <execinfo.h>   // backtrace()
+#include <fcntl.h>      // open()
+#include <time.h>       // clock_gettime()
+#include <sys/syscall.h> // SYS_mbind, SYS_getcpu
+#include <linux/mempolicy.h> // MPOL_PREFERRED
+#include <sys/auxv.h>    // getauxval()
+#include <signal.h>      // sigaction()
 
+using u16 = __UINT16_TYPE__;
 using u32 = __UINT32_TYPE__;
+using u64 = __UINT64_TYPE__;
+using uptr = __UINTPTR_TYPE__;
 
 template<class T>
-T max(T a, T b) { return a > b ? a : b; }
+constexpr T max(T a, T b) { return a > b ? a : b; }
+
+template<class T>
+constexpr T min(T a, T b) { return a < b ? a : b; }
 
 template<class T, size_t S>
 T* end(T (&a)[S])
@@ -17,6 +32,73 @@ T* end(T (&a)[S])
     return &a[S];
 }
 
+// <mutex> can't be used here, it pulls in <new> which defines placement new
+class Mutex
+{
+public:
+    void lock() { pthread_mutex_lock(&m_mutex); }
+    void unlock() { pthread_mutex_unlock(&m_mutex); }
+
+private:
+    pthread_mutex_t m_mutex = PTHREAD_MUTEX_INITIALIZER;
+};
+
+class Locker
+{
+public:
+    Locker(Mutex& mutex)
+    : m_mutex(mutex)
+    {
+        m_mutex.lock();
+    }
+
+    ~Locker() { m_mutex.unlock(); }
+
+    Locker(Locker const&) = delete;
+    Locker& operator=(Locker const&) = delete;
+
+private:
+    Mutex& m_mutex;
+};
+
+// Compile-time configuration of the heap. The debug profile keeps all the
+// hardening, the release one (built with HEAP_RELEASE) compiles it out.
+struct DebugPolicy
+{
+    // Fill memory with scrub bytes when it is handed out for the first time,
+    // to ease finding of uninitialized heap accesses, and overwrite removed
+    // headers. Otherwise, the blocks are left as the OS gave them (zeroed).
+    static constexpr bool scrub = true;
+    // Validate header signatures, boundary tags and cached regions on every
+    // heap operation, and look for double frees in thread caches.
+    static constexpr bool check_headers = true;
+    // Print informational messages
+    static constexpr bool diagnostics = true;
+    // Seal headers of used regions with a canary, checked when they are
+    // freed or resized. Unlike the checks above, it is cheap enough to stay
+    // in production.
+    static constexpr bool canary = true;
+};
+
+struct ReleasePolicy
+{
+    static constexpr bool scrub = false;
+    static constexpr bool check_headers = false;
+    static constexpr bool diagnostics = false;
+    static constexpr bool canary = true;
+};
+
+#ifdef HEAP_RELEASE
+using HeapPolicy = ReleasePolicy;
+#else
+using HeapPolicy = DebugPolicy;
+#endif
+
+// Default alignment of allocations, enough for any fundamental type (like
+// max_align_t). Region sizes and headers are multiples of it, so every
+// payload ends up aligned to it.
+constexpr size_t min_align = 16;
+
 enum class Signature : u32
 {
     Used =       0x2137D05A, // The memory is allocated.
@@ -25,404 +107,3682 @@ enum class Signature : u32
     Freed =      0x2137DEAD, // The memory was freed.
     BigBlock =   0xB16C8056, // Signature of a big block (should not occur in HeapBlock)
     ScrubBytes = 0xDEDEDEDE, // There was previously a header, but it was removed (e.g. because of merge)
+    Cached =     0x2137CAC4, // The memory was freed, but is kept in a size class free list for reuse.
 };
 
+// Random per process, so that canaries can't be forged by an overflow
+u64 g_canary_secret;
+
+u64 canary_secret()
+{
+    auto secret = __atomic_load_n(&g_canary_secret, __ATOMIC_RELAXED);
+    if(__builtin_expect(!secret, false))
+    {
+        // 16 random bytes given by the kernel to every process
+        memcpy(&secret, reinterpret_cast<void*>(getauxval(AT_RANDOM)), sizeof(secret));
+        secret |= 1;
+        __atomic_store_n(&g_canary_secret, secret, __ATOMIC_RELAXED);
+    }
+    return secret;
+}
+
 struct HeapHeader
 {
     Signature signature;
     u32 size {};
+    u32 prev_size {}; // Size of the previous region in the block, 0 for the first one (boundary tag)
+    u16 flags {};     // HeapHeader::Flags; unlike the rest, only the owner of the region changes them
+    u16 canary {};    // Of a used region, see seal()
+
+    enum Flags : u16
+    {
+        RemoteFreed = 1 << 0, // Region is queued to be freed by its arena
+    };
 
     HeapHeader* next() const
     {
         return size == 0 ? nullptr : (HeapHeader*)((char*)this + size) + 1;
     }
 
-    bool valid_signature() const
+    HeapHeader* prev() const
+    {
+        return prev_size == 0 ? nullptr : (HeapHeader*)((char*)this - prev_size) - 1;
+    }
+
+    // The canary depends on the address and the size, so it must be set
+    // again whenever a used region changes its size
+    u16 expected_canary() const
+    {
+        return (((uptr)this ^ ((u64)size << 32) ^ canary_secret()) * 0x9E3779B97F4A7C15) >> 48;
+    }
+
+    void seal()
+    {
+        if constexpr(HeapPolicy::canary)
+            canary = expected_canary();
+    }
+
+    // Aborts if the header of a region that is being freed or resized was
+    // overwritten, most likely by an overflow of the region before it
+    void check_canary(char const* caller) const
+    {
+        if(HeapPolicy::canary && (signature != Signature::Used || canary != expected_canary()))
+        {
+            printf("%s: Header of %p is corrupted (overflow of the region before it?)\n", caller, this + 1);
+            abort();
+        }
+    }
+
+    // Remove the header, e.g. when its region gets merged into a neighbor
+    void scrub()
+    {
+        if constexpr(HeapPolicy::scrub)
+            memset(this, 0xde, sizeof(HeapHeader));
+    }
+
+    bool valid_signature() const
+    {
+        return signature == Signature::BigBlock
+            || signature == Signature::Empty
+            || signature == Signature::Used
+            || signature == Signature::EndEdge
+            || signature == Signature::Freed
+            || signature == Signature::Cached;
+    }
+
+    bool available() const
+    {
+        return signature == Signature::Empty
+            || signature == Signature::Freed;
+    }
+
+    bool freed() const
+    {
+        return signature == Signature::Freed
+            || signature == Signature::Cached;
+    }
+
+    char const* signature_string() const
+    {
+        switch(signature)
+        {
+            case Signature::Used:       return "USED";
+            case Signature::Empty:      return "EMPTY";
+            case Signature::EndEdge:    return "END_EDGE";
+            case Signature::Freed:      return "FREED";
+            case Signature::BigBlock:   return "BIG_BLOCK";
+            case Signature::ScrubBytes: return "SCRUB_BYTES";
+            case Signature::Cached:     return "CACHED";
+            default:                    return nullptr;
+        }
+    }
+
+    void print_signature() const
+    {
+        if(signature_string())
+            printf("%s", signature_string());
+        else
+            printf("?0x%x?", signature);
+    }
+};
+
+// Counters that change rarely (on syscalls and when blocks are added or
+// removed), updated atomically from any thread. See my_heap_stats().
+struct GlobalCounters
+{
+    size_t mmap_count;
+    size_t munmap_count;
+    size_t mremap_count;
+    size_t bytes_mapped;
+    size_t heap_blocks;
+    size_t slabs;
+    size_t big_blocks;
+    size_t big_block_bytes;
+    size_t bump_blocks;
+};
+
+GlobalCounters g_counters;
+
+void count(size_t& counter, size_t value = 1)
+{
+    __atomic_fetch_add(&counter, value, __ATOMIC_RELAXED);
+}
+
+void uncount(size_t& counter, size_t value = 1)
+{
+    __atomic_fetch_sub(&counter, value, __ATOMIC_RELAXED);
+}
+
+class Arena;
+
+// Every block (a HeapBlock, a SlabBlock or a big block) is aligned to
+// heap_block_size and starts with its kind. Payloads are always within
+// (0, heap_block_size] bytes from the start of their block, so the kind of
+// any allocation can be found just by masking its address.
+enum class BlockKind : u32
+{
+    Heap = 0x4EA9B10C, // HeapBlock: regions with headers
+    Slab = 0x51ABB10C, // SlabBlock: header-free objects of a single size class
+    Big =  0xB16B10C0, // A single big allocation, mapped directly from the OS
+    Bump = 0xB0A1B10C, // Chunk of a BumpArena: objects without headers, freed all at once
+    Guarded = 0x6A2DB10C, // Slot of GuardedPool: a single sampled allocation between guard pages
+};
+
+void* block_of(void* addr)
+{
+    return reinterpret_cast<void*>((reinterpret_cast<uptr>(addr) - 1) & ~(uptr)(heap_block_size - 1));
+}
+
+BlockKind block_kind_of(void* addr)
+{
+    return *static_cast<BlockKind*>(block_of(addr));
+}
+
+// Space before the first payload of an available region that is aligned to
+// `align` and leaves either nothing or a whole region (header + min_align
+// bytes) before it
+size_t aligned_lead(HeapHeader const* header, size_t align)
+{
+    auto start = reinterpret_cast<uptr>(header + 1);
+    auto aligned = (start + align - 1) & ~(uptr)(align - 1);
+    if(aligned != start && aligned - start < sizeof(HeapHeader) + min_align)
+        aligned += align;
+    return aligned - start;
+}
+
+// Whether an aligned region of `size` bytes, followed by a header of the
+// rest, fits in an available region
+bool region_fits(HeapHeader const* header, size_t size, size_t align)
+{
+    return header->size >= aligned_lead(header, align) + size + sizeof(HeapHeader) * 2;
+}
+
+HeapPlacement g_placement { HeapPlacement::FirstFit };
+
+HeapPlacement placement()
+{
+    return __atomic_load_n(&g_placement, __ATOMIC_RELAXED);
+}
+
+// Node of an available region in FreeRegions, in its payload (which is
+// always at least min_align bytes)
+struct FreeRegionNode
+{
+    FreeRegionNode* next;
+    FreeRegionNode* prev;
+};
+
+static_assert(sizeof(FreeRegionNode) <= min_align);
+
+// Exact bins of sizes below 1 KiB, then 4 bins per power of 2 (up to the
+// biggest block size)
+constexpr size_t free_region_exact_bins = 1024 / min_align;
+constexpr size_t free_region_bin_count = free_region_exact_bins + (30 - 10) * 4;
+
+// Regions of a bin compared by best_fit(), when there are more that fit
+constexpr size_t best_fit_candidates = 16;
+
+// Blocks are indexed by the largest free region they may have, in buckets
+// of powers of 2 (from 16 bytes up to the biggest block size)
+constexpr size_t space_bucket_count = 30 - 4;
+
+size_t space_bucket_of(size_t size)
+{
+    return 63 - __builtin_clzll(size) - 4;
+}
+
+constexpr size_t space_bucket_size(size_t bucket)
+{
+    return (size_t)16 << bucket;
+}
+
+class HeapBlock;
+
+// Available (EMPTY and FREED) regions of the heap blocks of an arena, in
+// bins by size. They are kept for every placement policy, so that it can be
+// changed at any time, and give the free space to my_heap_stats(). For the
+// header walks, it also keeps which blocks are worth searching.
+class FreeRegions
+{
+public:
+    void insert(HeapHeader* header);
+    // The region must still have the size it was inserted with. Returns
+    // whether it was the next-fit position, which is cleared then.
+    bool remove(HeapHeader* header);
+
+    // The smallest region (of a few candidates) that a region of `size`
+    // bytes aligned to `align` fits in, or null
+    HeapHeader* best_fit(size_t size, size_t align) const;
+
+    // Available region where the next-fit search resumes, or null
+    HeapHeader* rover() const { return m_rover; }
+    void set_rover(HeapHeader* header) { m_rover = header; }
+
+    // No block before this one (in the block list) has a free region of
+    // space_bucket_size(bucket) bytes or more; null if no block has one
+    HeapBlock*& first_block_with_space(size_t bucket) { return m_blocks_with_space[bucket]; }
+
+    // Can be read without the lock
+    size_t free_bytes() const { return __atomic_load_n(&m_bytes, __ATOMIC_RELAXED); }
+    size_t region_count() const { return __atomic_load_n(&m_count, __ATOMIC_RELAXED); }
+
+private:
+    static size_t bin_of(size_t size);
+    // The first non-empty bin after `bin`, or free_region_bin_count
+    size_t next_bin(size_t bin) const;
+    HeapHeader* scan(size_t bin, size_t size, size_t align, size_t limit) const;
+
+    FreeRegionNode* m_heads[free_region_bin_count] {};
+    u64 m_nonempty[(free_region_bin_count + 63) / 64] {};
+    HeapHeader* m_rover {};
+    HeapBlock* m_blocks_with_space[space_bucket_count] {};
+    size_t m_bytes {};
+    size_t m_count {};
+};
+
+size_t FreeRegions::bin_of(size_t size)
+{
+    if(size < 1024)
+        return size / min_align;
+    size_t log = 63 - __builtin_clzll(size);
+    return free_region_exact_bins + (log - 10) * 4 + ((size >> (log - 2)) & 3);
+}
+
+size_t FreeRegions::next_bin(size_t bin) const
+{
+    bin++;
+    for(size_t word = bin / 64; word < sizeof(m_nonempty) / sizeof(m_nonempty[0]); word++)
+    {
+        auto bits = m_nonempty[word];
+        if(word == bin / 64)
+            bits &= ~(u64)0 << (bin % 64);
+        if(bits)
+            return word * 64 + __builtin_ctzll(bits);
+    }
+    return free_region_bin_count;
+}
+
+void FreeRegions::insert(HeapHeader* header)
+{
+    auto bin = bin_of(header->size);
+    auto node = reinterpret_cast<FreeRegionNode*>(header + 1);
+    node->next = m_heads[bin];
+    node->prev = nullptr;
+    if(node->next)
+        node->next->prev = node;
+    m_heads[bin] = node;
+    m_nonempty[bin / 64] |= (u64)1 << (bin % 64);
+    __atomic_store_n(&m_bytes, m_bytes + header->size, __ATOMIC_RELAXED);
+    __atomic_store_n(&m_count, m_count + 1, __ATOMIC_RELAXED);
+}
+
+bool FreeRegions::remove(HeapHeader* header)
+{
+    auto bin = bin_of(header->size);
+    auto node = reinterpret_cast<FreeRegionNode*>(header + 1);
+    if(HeapPolicy::check_headers && ((node->prev ? node->prev->next : m_heads[bin]) != node || (node->next && node->next->prev != node)))
+    {
+        printf("FreeRegions::remove: Corrupted free region %p\n", header);
+        abort();
+    }
+
+    if(node->next)
+        node->next->prev = node->prev;
+    if(node->prev)
+        node->prev->next = node->next;
+    else
+    {
+        m_heads[bin] = node->next;
+        if(!node->next)
+            m_nonempty[bin / 64] &= ~((u64)1 << (bin % 64));
+    }
+    __atomic_store_n(&m_bytes, m_bytes - header->size, __ATOMIC_RELAXED);
+    __atomic_store_n(&m_count, m_count - 1, __ATOMIC_RELAXED);
+
+    if(m_rover != header)
+        return false;
+    m_rover = nullptr;
+    return true;
+}
+
+HeapHeader* FreeRegions::scan(size_t bin, size_t size, size_t align, size_t limit) const
+{
+    HeapHeader* best = nullptr;
+    size_t scanned = 0;
+    for(auto node = m_heads[bin]; node && scanned < limit; node = node->next, scanned++)
+    {
+        // Of the same sizes, lower addresses keep the end of the heap free
+        auto header = reinterpret_cast<HeapHeader*>(node) - 1;
+        if(!region_fits(header, size, align) || (best && (header->size > best->size || (header->size == best->size && header > best))))
+            continue;
+        best = header;
+    }
+    return best;
+}
+
+HeapHeader* FreeRegions::best_fit(size_t size, size_t align) const
+{
+    // The first bin may have regions that are too small, the next ones only
+    // have big enough regions (unless the alignment needs more)
+    auto first = bin_of(size + sizeof(HeapHeader) * 2);
+    if(auto header = scan(first, size, align, best_fit_candidates))
+        return header;
+    for(auto bin = next_bin(first); bin < free_region_bin_count; bin = next_bin(bin))
+    {
+        if(auto header = scan(bin, size, align, best_fit_candidates))
+            return header;
+    }
+    // Don't grow the heap just because the first candidates were too small
+    return scan(first, size, align, ~(size_t)0);
+}
+
+FreeRegions& free_regions_of(Arena* arena);
+
+class HeapBlock
+{
+public:
+    // `zeroed` tells whether the memory is known to be zero
+    HeapBlock(HeapBlock* prev, Arena* arena, bool zeroed = true)
+    : m_order(prev ? prev->m_order + 1 : 0)
+    , m_arena(arena)
+    , m_prev(prev)
+    {
+        init(zeroed);
+    }
+
+    Arena* arena() const { return m_arena; }
+
+    // If `zero` is set, the region is zeroed (only the part of it that is
+    // not known to be zeroed already)
+    void* alloc(size_t size, size_t align, bool zero = false);
+    // Allocate `count` regions of `size` bytes in a single walk of the
+    // headers (of this block and the next ones)
+    void alloc_batch(size_t size, size_t count, void** addrs);
+    void free(void* addr);
+    // Grow or shrink the region in place, if possible
+    bool resize(void* addr, size_t size);
+    // Calls the callback for the used regions; false if a corrupted header
+    // was found (it is skipped)
+    bool walk(HeapWalkCallback callback, void* context);
+    void dump();
+
+    HeapBlock* next() const { return m_next; }
+
+    // Blocks are always heap_block_size-aligned, so the owning block of any
+    // in-block address can be found just by masking it.
+    static HeapBlock* containing(void* addr)
+    {
+        return reinterpret_cast<HeapBlock*>(reinterpret_cast<uptr>(addr) & ~(uptr)(heap_block_size - 1));
+    }
+
+    // Biggest region that fits in an empty block (next to its own header,
+    // the smallest EMPTY remainder and the END_EDGE header)
+    static constexpr size_t max_alloc_size();
+    // Whether a region of `size` bytes aligned to `align` always fits in an
+    // empty block, also when a region has to be left before it for alignment
+    static constexpr bool fits(size_t size, size_t align);
+
+private:
+    void init(bool zeroed);
+    void place_edge_headers();
+    // Searches from `cursor` on, and moves it after the allocated region
+    void* alloc_in_block(size_t size, size_t align, bool zero, HeapHeader*& cursor);
+    // Allocates at the start of an available region that it fits in
+    void* alloc_at(HeapHeader* header, size_t size, size_t align, bool zero);
+    // First fit in the blocks from `from` up to `until` (null for the
+    // end of the list), skipping the blocks without a big enough region
+    static void* search(HeapBlock* from, HeapBlock* until, size_t size, size_t align, bool zero, HeapHeader*& cursor);
+    void add_free_region(HeapHeader* header);
+    bool remove_free_region(HeapHeader* header);
+    HeapBlock* last();
+
+    // Region maps: a bit per min_align bytes of m_data, set where a header
+    // starts, and where an available region starts
+    size_t granule_of(HeapHeader const* header) const { return (reinterpret_cast<char const*>(header) - m_data) / min_align; }
+    HeapHeader* header_at(size_t granule) { return reinterpret_cast<HeapHeader*>(m_data + granule * min_align); }
+    bool is_header(HeapHeader const* header) const;
+    void add_header(HeapHeader* header);
+    void remove_header(HeapHeader* header);
+    HeapHeader* first_header() { return reinterpret_cast<HeapHeader*>(m_data); }
+    void ensure_next_allocated_from_os();
+    void merge_and_cleanup(HeapHeader* header);
+    void mark_touched(void* end);
+    // Fills the part of [begin, end) from `fresh` on with scrub bytes
+    void scrub_fresh(char* begin, char* end, char* fresh);
+
+    BlockKind m_kind { BlockKind::Heap };
+    // Data from this offset on was never handed out since the block came
+    // from the OS, so it is still zero (except for headers of free regions)
+    u32 m_fresh_offset {};
+    // No free region in the block is bigger than this (it is exact after a
+    // failed search of the whole block)
+    u32 m_largest_free {};
+    // Increases along the block list, new blocks are only added at its end
+    u64 m_order {};
+    Arena* m_arena {};
+    HeapBlock* m_prev {};
+    HeapBlock* m_next {};
+    // Out of the way of the payloads, so overflows don't reach them, and
+    // scanned a word at a time instead of following the headers
+    static constexpr size_t region_map_words = heap_block_size / min_align / 64;
+    u64 m_header_map[region_map_words] {};
+    u64 m_free_map[region_map_words] {};
+    alignas(min_align) char m_data[heap_block_size - sizeof(void*) * 6 - sizeof(u64) * region_map_words * 2];
+};
+
+static_assert(sizeof(HeapBlock) == heap_block_size);
+
+constexpr size_t HeapBlock::max_alloc_size()
+{
+    return sizeof(m_data) - sizeof(HeapHeader) * 4;
+}
+
+constexpr bool HeapBlock::fits(size_t size, size_t align)
+{
+    // The region before an aligned payload takes at most `align` bytes plus
+    // the header of the aligned region
+    if(align > min_align)
+        return size <= max_alloc_size() && size + align + sizeof(HeapHeader) <= max_alloc_size();
+    return size <= max_alloc_size();
+}
+
+void HeapBlock::place_edge_headers()
+{
+    new (m_data) HeapHeader {Signature::Empty, sizeof(m_data) - sizeof(HeapHeader) * 2};
+    new (end(m_data) - sizeof(HeapHeader)) HeapHeader {Signature::EndEdge, 0, sizeof(m_data) - sizeof(HeapHeader) * 2};
+    add_header(first_header());
+    add_header(reinterpret_cast<HeapHeader*>(end(m_data)) - 1);
+    add_free_region(first_header());
+}
+
+void HeapBlock::init(bool zeroed)
+{
+    // The first payload must be aligned (the block itself is aligned to its size)
+    static_assert((sizeof(HeapBlock) - sizeof(m_data) + sizeof(HeapHeader)) % min_align == 0);
+    static_assert(sizeof(m_data) % min_align == 0);
+    count(g_counters.heap_blocks);
+
+    // Only the headers are written, so the pages in between are faulted in
+    // when regions are handed out. A zeroed block is scrubbed on the way, a
+    // reused one only as a whole.
+    if(zeroed)
+        m_fresh_offset = sizeof(HeapHeader);
+    else
+    {
+        if constexpr(HeapPolicy::scrub)
+            memset(m_data + sizeof(HeapHeader), 0xef, sizeof(m_data) - sizeof(HeapHeader) * 2);
+        m_fresh_offset = sizeof(m_data);
+    }
+    place_edge_headers();
+}
+
+void HeapBlock::scrub_fresh(char* begin, char* end, char* fresh)
+{
+    // The space left for a header before `fresh` was not written either
+    begin = max(begin, fresh - sizeof(HeapHeader));
+    if(end > begin)
+        memset(begin, 0xef, end - begin);
+}
+
+void HeapBlock::mark_touched(void* end)
+{
+    // Leave place for a header that may be placed right after
+    m_fresh_offset = max<u32>(m_fresh_offset, (char*)end + sizeof(HeapHeader) - m_data);
+}
+
+bool HeapBlock::is_header(HeapHeader const* header) const
+{
+    auto granule = granule_of(header);
+    return m_header_map[granule / 64] & (u64)1 << (granule % 64);
+}
+
+void HeapBlock::add_header(HeapHeader* header)
+{
+    auto granule = granule_of(header);
+    m_header_map[granule / 64] |= (u64)1 << (granule % 64);
+}
+
+void HeapBlock::remove_header(HeapHeader* header)
+{
+    auto granule = granule_of(header);
+    m_header_map[granule / 64] &= ~((u64)1 << (granule % 64));
+    header->scrub();
+}
+
+bool HeapBlock::remove_free_region(HeapHeader* header)
+{
+    auto granule = granule_of(header);
+    m_free_map[granule / 64] &= ~((u64)1 << (granule % 64));
+    return free_regions_of(m_arena).remove(header);
+}
+
+void HeapBlock::add_free_region(HeapHeader* header)
+{
+    auto& regions = free_regions_of(m_arena);
+    regions.insert(header);
+    auto granule = granule_of(header);
+    m_free_map[granule / 64] |= (u64)1 << (granule % 64);
+    // The node is in the payload, so it is not zero anymore
+    mark_touched(reinterpret_cast<FreeRegionNode*>(header + 1) + 1);
+
+    // The block may have space for bigger regions now
+    if(header->size <= m_largest_free)
+        return;
+    size_t bucket = m_largest_free ? space_bucket_of(m_largest_free) + 1 : 0;
+    m_largest_free = header->size;
+    for(; bucket <= space_bucket_of(m_largest_free); bucket++)
+    {
+        auto& first = regions.first_block_with_space(bucket);
+        if(!first || first->m_order > m_order)
+            first = this;
+    }
+}
+
+HeapBlock* HeapBlock::last()
+{
+    auto block = this;
+    while(block->m_next)
+        block = block->m_next;
+    return block;
+}
+
+// mmap(), munmap() and mremap() of anonymous memory, counted in statistics.
+// Sizes are page multiples.
+void* os_map(size_t size, int flags = 0)
+{
+    auto memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    if(memory == MAP_FAILED)
+        return nullptr;
+    count(g_counters.mmap_count);
+    count(g_counters.bytes_mapped, size);
+    return memory;
+}
+
+int os_unmap(void* memory, size_t size)
+{
+    count(g_counters.munmap_count);
+    uncount(g_counters.bytes_mapped, size);
+    return munmap(memory, size);
+}
+
+// With MREMAP_FIXED, `target` must be a mapping of `new_size` bytes, which
+// gets replaced
+void* os_remap(void* memory, size_t old_size, size_t new_size, int flags, void* target = nullptr)
+{
+    auto new_memory = mremap(memory, old_size, new_size, flags, target);
+    if(new_memory == MAP_FAILED)
+        return nullptr;
+    count(g_counters.mremap_count);
+    count(g_counters.bytes_mapped, new_size);
+    uncount(g_counters.bytes_mapped, old_size);
+    if(flags & MREMAP_FIXED)
+        uncount(g_counters.bytes_mapped, new_size);
+    return new_memory;
+}
+
+// mmap() only guarantees page alignment, so map `align` bytes more and
+// unmap the unaligned head and the tail. The result is such that
+// `result + skew` is aligned (`size` and `skew` must be page multiples).
+void* map_aligned(size_t size, size_t align, size_t skew = 0)
+{
+    auto memory = (char*)os_map(size + align);
+    if(!memory)
+        return nullptr;
+
+    auto aligned = (char*)(((reinterpret_cast<uptr>(memory) + skew + align - 1) & ~(uptr)(align - 1)) - skew);
+    if(aligned != memory)
+        os_unmap(memory, aligned - memory);
+    os_unmap(aligned + size, memory + align - aligned);
+    return aligned;
+}
+
+// NUMA nodes (at most this many, with ids below it) that arenas are spread
+// over; without NUMA, there is one and memory is not bound to it
+constexpr size_t max_numa_nodes = 64;
+
+size_t g_numa_node_count;
+u32 g_numa_nodes[max_numa_nodes];
+
+// Parses /sys/devices/system/node/online (like "0-1,3"). This runs on the
+// first allocation, so it uses no stdio (which would allocate).
+void read_numa_nodes()
+{
+    char text[256];
+    ssize_t length = -1;
+    int file = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+    if(file >= 0)
+    {
+        length = read(file, text, sizeof(text) - 1);
+        close(file);
+    }
+    size_t count = 0;
+    if(length > 0)
+    {
+        text[length] = '\0';
+        for(char* cursor = text; *cursor >= '0' && *cursor <= '9';)
+        {
+            auto first = strtoul(cursor, &cursor, 10);
+            auto last = first;
+            if(*cursor == '-')
+                last = strtoul(cursor + 1, &cursor, 10);
+            for(auto node = first; node <= last && node < max_numa_nodes; node++)
+                g_numa_nodes[count++] = node;
+            if(*cursor == ',')
+                cursor++;
+        }
+    }
+    if(!count)
+        g_numa_nodes[count++] = 0;
+    __atomic_store_n(&g_numa_node_count, count, __ATOMIC_RELAXED);
+}
+
+// Node of the CPU the calling thread runs on
+u32 current_numa_node()
+{
+    unsigned cpu, node;
+    if(syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+        return 0;
+    return node;
+}
+
+// Ask for the pages of a mapping to be allocated on `node`, whichever thread
+// touches them first. Only preferred, so that a full node doesn't make
+// allocations fail; errors (e.g. no NUMA support) are ignored.
+void bind_to_node(void* memory, size_t size, u32 node)
+{
+    if(g_numa_node_count < 2)
+        return;
+    u64 mask = (u64)1 << node;
+    syscall(SYS_mbind, memory, size, MPOL_PREFERRED, &mask, max_numa_nodes + 1, 0);
+}
+
+// Blocks retained in a BlockPool, at most (1 MiB worth of them)
+constexpr size_t retained_blocks = max<size_t>((1 << 20) / heap_block_size, 4);
+// Retained blocks that keep their pages; older ones are given back to the
+// OS with MADV_DONTNEED (but stay mapped, and are zero when touched again)
+constexpr size_t retained_dirty_blocks = max<size_t>(retained_blocks / 16, 1);
+// New blocks are carved from a region of this many blocks, reserved from
+// the OS at once
+constexpr size_t reserved_blocks = 64;
+
+// Empty heap blocks and slabs of an arena, kept for reuse instead of being
+// unmapped as soon as they become empty, so that bursty workloads don't
+// map and unmap blocks all the time. Protected by the arena lock.
+class BlockPool
+{
+public:
+    // A block-sized and block-aligned piece of memory, from the pool or
+    // the reserved region; `zeroed` tells whether it is known to be zero
+    void* take(bool& zeroed);
+    void put(void* block);
+
+    // Node that new memory is bound to
+    void set_node(u32 node) { m_node = node; }
+
+private:
+    // Oldest first; the last m_dirty ones still have their pages
+    void* m_blocks[retained_blocks] {};
+    size_t m_count {};
+    size_t m_dirty {};
+    // Rest of the reserved region, never used yet
+    char* m_reserved {};
+    size_t m_reserved_count {};
+    u32 m_node {};
+};
+
+void* BlockPool::take(bool& zeroed)
+{
+    if(!m_count)
+    {
+        if(!m_reserved_count)
+        {
+            // Request new memory blocks from the OS. The pages are only
+            // allocated when touched, so this is cheap.
+            m_reserved = (char*)map_aligned(heap_block_size * reserved_blocks, heap_block_size);
+            if(!m_reserved)
+            {
+                perror("BlockPool::take: mmap");
+                abort();
+            }
+            bind_to_node(m_reserved, heap_block_size * reserved_blocks, m_node);
+            m_reserved_count = reserved_blocks;
+        }
+        auto memory = m_reserved;
+        m_reserved += heap_block_size;
+        m_reserved_count--;
+        zeroed = true;
+        return memory;
+    }
+
+    zeroed = !m_dirty;
+    if(m_dirty)
+        m_dirty--;
+    return m_blocks[--m_count];
+}
+
+void BlockPool::put(void* block)
+{
+    if(m_count == retained_blocks)
+    {
+        if(os_unmap(m_blocks[0], heap_block_size) < 0)
+        {
+            perror("BlockPool::put: munmap");
+            abort();
+        }
+        if(m_dirty == m_count)
+            m_dirty--;
+        memmove(&m_blocks[0], &m_blocks[1], (m_count - 1) * sizeof(void*));
+        m_count--;
+    }
+
+    m_blocks[m_count++] = block;
+    if(++m_dirty > retained_dirty_blocks)
+    {
+        auto oldest_dirty = m_blocks[m_count - m_dirty];
+        if(madvise(oldest_dirty, heap_block_size, MADV_DONTNEED) < 0)
+        {
+            perror("BlockPool::put: madvise");
+            abort();
+        }
+        m_dirty--;
+    }
+}
+
+BlockPool& block_pool_of(Arena* arena);
+
+void HeapBlock::ensure_next_allocated_from_os()
+{
+    if(!m_next)
+    {
+        bool zeroed;
+        auto memory = block_pool_of(m_arena).take(zeroed);
+        m_next = reinterpret_cast<HeapBlock*>(memory);
+        new(m_next) HeapBlock{this, m_arena, zeroed};
+    }
+}
+
+void HeapBlock::merge_and_cleanup(HeapHeader* header)
+{
+    // Merge with adjacent regions only, they are found through the size and
+    // prev_size of the header, so there is no need to walk the whole block.
+    // The merged region takes over the next-fit position of its parts.
+    auto& regions = free_regions_of(m_arena);
+    bool rover = false;
+    auto next_header = header->next();
+    if(next_header->available())
+    {
+        rover |= remove_free_region(next_header);
+        header->size += next_header->size + sizeof(HeapHeader);
+        remove_header(next_header);
+        header->next()->prev_size = header->size;
+    }
+
+    auto prev_header = header->prev();
+    if(prev_header && prev_header->available())
+    {
+        rover |= remove_free_region(prev_header);
+        prev_header->size += header->size + sizeof(HeapHeader);
+        remove_header(header);
+        prev_header->next()->prev_size = prev_header->size;
+        header = prev_header;
+    }
+
+    // Remove the whole block if it is made up from just freed blocks
+    if(!header->prev() && header->size == sizeof(m_data) - sizeof(HeapHeader) * 2)
+    {
+        if(m_prev)
+        {
+            for(size_t bucket = 0; bucket < space_bucket_count; bucket++)
+            {
+                auto& first = regions.first_block_with_space(bucket);
+                if(first == this)
+                    first = m_next;
+            }
+            if(m_next)
+                m_next->m_prev = m_prev;
+            m_prev->m_next = m_next;
+            // !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+            // WARNING: This is very unsafe when done improperly.
+            // Don't do ANYTHING after this instruction 
+            // !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+            uncount(g_counters.heap_blocks);
+            block_pool_of(m_arena).put(this);
+            return;
+        }
+    }
+    add_free_region(header);
+    if(rover)
+        regions.set_rover(header);
+}
+
+void* HeapBlock::alloc(size_t size, size_t align, bool zero)
+{
+    if(align == 0)
+    {
+        printf("heap_alloc_impl: Invalid align!\n");
+        return nullptr;
+    }
+
+    align = max(min_align, align);
+
+    // Align size (round up, but never leave an empty region). The payload
+    // address is aligned separately, so min_align is enough here.
+    size_t old_size = size;
+    //printf("Size before align %zx: %zu\n", min_align - 1, size);
+    size = max((size + min_align - 1) & ~(min_align - 1), min_align);
+    // sanity check
+    assert(old_size <= size);
+    //printf("Size after align: %zu\n", size);
+    if(!fits(size, align))
+    {
+        printf("HeapBlock::alloc: Size %zu (align %zu) doesn't fit in a heap block\n", size, align);
+        return nullptr;
+    }
+
+    auto policy = placement();
+    auto& regions = free_regions_of(m_arena);
+    auto& first = regions.first_block_with_space(space_bucket_of(size + sizeof(HeapHeader) * 2));
+    void* addr = nullptr;
+    HeapHeader* cursor = nullptr;
+    if(policy == HeapPlacement::BestFit)
+    {
+        if(auto header = regions.best_fit(size, align))
+            return containing(header)->alloc_at(header, size, align, zero);
+    }
+    else if(policy == HeapPlacement::NextFit && regions.rover())
+    {
+        // Start where the last allocation ended, and wrap around to the first
+        // block once (the block of the rover is searched again)
+        cursor = regions.rover();
+        auto rover_block = containing(cursor);
+        if(rover_block->m_largest_free >= size + sizeof(HeapHeader) * 2)
+            addr = rover_block->alloc_in_block(size, align, zero, cursor);
+        if(!addr)
+            addr = search(rover_block->m_next, nullptr, size, align, zero, cursor);
+        if(!addr && first && first->m_order <= rover_block->m_order)
+            addr = search(first, rover_block->m_next, size, align, zero, cursor);
+    }
+    else
+        addr = search(first, nullptr, size, align, zero, cursor);
+
+    if(!addr)
+    {
+        // Nothing fits, so add a block at the end
+        auto block = last();
+        block->ensure_next_allocated_from_os();
+        cursor = block->m_next->first_header();
+        addr = block->m_next->alloc_in_block(size, align, zero, cursor);
+    }
+    if(policy == HeapPlacement::NextFit)
+        regions.set_rover(cursor);
+    return addr;
+}
+
+void* HeapBlock::search(HeapBlock* from, HeapBlock* until, size_t size, size_t align, bool zero, HeapHeader*& cursor)
+{
+    if(!from)
+        return nullptr;
+    size_t needed = size + sizeof(HeapHeader) * 2;
+    auto bucket = space_bucket_of(needed);
+    auto& first = free_regions_of(from->m_arena).first_block_with_space(bucket);
+    for(auto block = from; block && block != until; block = block->m_next)
+    {
+        if(block->m_largest_free >= needed)
+        {
+            cursor = block->first_header();
+            if(auto addr = block->alloc_in_block(size, align, zero, cursor))
+                return addr;
+        }
+        // The search would skip it next time too
+        if(first == block && block->m_largest_free < space_bucket_size(bucket))
+            first = block->m_next;
+    }
+    return nullptr;
+}
+
+void HeapBlock::alloc_batch(size_t size, size_t count, void** addrs)
+{
+    size = max((size + min_align - 1) & ~(min_align - 1), min_align);
+    assert(fits(size, min_align));
+
+    // Other policies than first-fit don't search from the first block anyway
+    if(placement() != HeapPlacement::FirstFit)
+    {
+        for(size_t i = 0; i < count; i++)
+            addrs[i] = alloc(size, min_align);
+        return;
+    }
+
+    // Like alloc(), but every search continues where the previous one ended
+    size_t needed = size + sizeof(HeapHeader) * 2;
+    HeapBlock* block = free_regions_of(m_arena).first_block_with_space(space_bucket_of(needed));
+    if(!block)
+    {
+        block = last();
+        block->ensure_next_allocated_from_os();
+        block = block->m_next;
+    }
+    auto cursor = block->first_header();
+    for(size_t i = 0; i < count;)
+    {
+        if(block->m_largest_free >= needed)
+        {
+            if(auto addr = block->alloc_in_block(size, min_align, false, cursor))
+            {
+                addrs[i++] = addr;
+                continue;
+            }
+        }
+        block->ensure_next_allocated_from_os();
+        block = block->m_next;
+        cursor = block->first_header();
+    }
+}
+
+void* HeapBlock::alloc_in_block(size_t size, size_t align, bool zero, HeapHeader*& cursor)
+{
+    // Only the available regions are visited, in the order of addresses
+    auto first = granule_of(cursor);
+    // A search of the whole block finds its largest free region
+    bool whole_block = first == 0;
+    u32 largest_free = 0;
+
+    for(size_t word = first / 64; word < region_map_words; word++)
+    {
+        auto bits = m_free_map[word];
+        if(word == first / 64)
+            bits &= ~(u64)0 << (first % 64);
+        for(; bits; bits &= bits - 1)
+        {
+            auto header = header_at(word * 64 + __builtin_ctzll(bits));
+            if(HeapPolicy::check_headers && !header->available())
+            {
+                printf("heap_alloc_impl: Invalid header signature %x at %p\n", (u32)header->signature, header);
+                abort();
+            }
+            if(region_fits(header, size, align))
+            {
+                auto payload = alloc_at(header, size, align, zero);
+                cursor = (reinterpret_cast<HeapHeader*>(payload) - 1)->next();
+                return payload;
+            }
+            largest_free = max(largest_free, header->size);
+        }
+    }
+    if(whole_block)
+        m_largest_free = largest_free;
+    return nullptr;
+}
+
+void* HeapBlock::alloc_at(HeapHeader* header, size_t size, size_t align, bool zero)
+{
+    // Headers and nodes of free regions written below are not in the payload
+    auto fresh = m_data + m_fresh_offset;
+    remove_free_region(header);
+
+    size_t lead = aligned_lead(header, align);
+    if(lead)
+    {
+        // Leave the space before the aligned payload as a separate available
+        // region
+        auto aligned_header = reinterpret_cast<HeapHeader*>(reinterpret_cast<char*>(header + 1) + lead) - 1;
+        new (aligned_header) HeapHeader {header->signature, static_cast<u32>(header->size - lead), static_cast<u32>(lead - sizeof(HeapHeader))};
+        header->size = lead - sizeof(HeapHeader);
+        aligned_header->next()->prev_size = aligned_header->size;
+        add_header(aligned_header);
+        add_free_region(header);
+        header = aligned_header;
+    }
+
+    auto distance_to_next_header = header->size - size - sizeof(HeapHeader);
+
+    // set old header to be used
+    header->signature = Signature::Used;
+    header->size = size;
+    header->seal();
+
+    // create a new header after data
+    auto new_header_address = header->next();
+    new (new_header_address) HeapHeader {Signature::Empty, static_cast<u32>(distance_to_next_header), static_cast<u32>(size)};
+    new_header_address->next()->prev_size = distance_to_next_header;
+    add_header(new_header_address);
+    add_free_region(new_header_address);
+
+    auto payload = reinterpret_cast<char*>(header + 1);
+    if(zero && payload < fresh)
+        memset(payload, 0, min(payload + size, fresh) - payload);
+    if constexpr(HeapPolicy::scrub)
+        if(!zero)
+            scrub_fresh(payload, payload + size, fresh);
+    mark_touched(payload + size);
+    return payload;
+}
+
+void HeapBlock::free(void* addr)
+{
+    HeapHeader* header = reinterpret_cast<HeapHeader*>(addr) - 1;
+    if(addr < m_data + sizeof(HeapHeader) || addr >= end(m_data) || (uptr)addr % min_align || !is_header(header))
+    {
+        printf("HeapBlock::free: %p was not allocated on heap\n", addr);
+        abort();
+    }
+
+    if(header->freed())
+    {
+        printf("HeapBlock::free: Block already freed\n");
+        abort();
+    }
+    if constexpr(HeapPolicy::check_headers)
+    {
+        if(!header->valid_signature())
+        {
+            printf("HeapBlock::free: Invalid header signature %x (addr=%p)\n", (u32)header->signature, header);
+            abort();
+        }
+        // Boundary tags of neighbors must point back to this header
+        auto prev_header = header->prev();
+        if(header->next()->prev() != header || (prev_header && prev_header->next() != header))
+        {
+            printf("HeapBlock::free: Corrupted boundary tags (addr=%p)\n", header);
+            abort();
+        }
+    }
+
+    header->signature = Signature::Freed;
+    merge_and_cleanup(header);
+}
+
+bool HeapBlock::resize(void* addr, size_t size)
+{
+    HeapHeader* header = reinterpret_cast<HeapHeader*>(addr) - 1;
+    if(HeapPolicy::check_headers && (!is_header(header) || header->signature != Signature::Used))
+    {
+        printf("HeapBlock::resize: Invalid header signature %x (addr=%p)\n", (u32)header->signature, header);
+        abort();
+    }
+
+    size = max((size + min_align - 1) & ~(min_align - 1), min_align);
+    if(size <= header->size)
+    {
+        // Shrink, if the rest is big enough to become a region on its own.
+        // It was used before, so it is FREED, not EMPTY.
+        if(header->size - size < sizeof(HeapHeader) + min_align)
+            return true;
+        u32 rest_size = header->size - size - sizeof(HeapHeader);
+        header->size = size;
+        header->seal();
+        auto rest = header->next();
+        new (rest) HeapHeader {Signature::Freed, rest_size, static_cast<u32>(size)};
+        rest->next()->prev_size = rest_size;
+        add_header(rest);
+        merge_and_cleanup(rest);
+        return true;
+    }
+
+    // Grow into the next region, splitting it as alloc() does
+    auto next_header = header->next();
+    if(!next_header->available())
+        return false;
+    size_t total_size = header->size + sizeof(HeapHeader) + next_header->size;
+    if(total_size < size)
+        return false;
+
+    auto fresh = m_data + m_fresh_offset;
+    auto following_header = next_header->next();
+    auto signature = next_header->signature;
+    bool rover = remove_free_region(next_header);
+    remove_header(next_header);
+    if(total_size - size < sizeof(HeapHeader) + min_align)
+    {
+        // Not enough left for a region, just take all of it
+        header->size = total_size;
+        header->seal();
+        if constexpr(HeapPolicy::scrub)
+            scrub_fresh(reinterpret_cast<char*>(next_header), reinterpret_cast<char*>(following_header), fresh);
+        following_header->prev_size = total_size;
+        mark_touched(following_header);
+        return true;
+    }
+
+    u32 rest_size = total_size - size - sizeof(HeapHeader);
+    header->size = size;
+    header->seal();
+    if constexpr(HeapPolicy::scrub)
+        scrub_fresh(reinterpret_cast<char*>(next_header), reinterpret_cast<char*>(header->next()), fresh);
+    new (header->next()) HeapHeader {signature, rest_size, static_cast<u32>(size)};
+    following_header->prev_size = rest_size;
+    mark_touched(header->next());
+    add_header(header->next());
+    add_free_region(header->next());
+    if(rover)
+        free_regions_of(m_arena).set_rover(header->next());
+    return true;
+}
+
+bool HeapBlock::walk(HeapWalkCallback callback, void* context)
+{
+    // Headers are found in the region map, so a corrupted one doesn't hide
+    // the rest of the block
+    bool valid = true;
+    for(size_t word = 0; word < region_map_words; word++)
+    {
+        for(auto bits = m_header_map[word]; bits; bits &= bits - 1)
+        {
+            auto header = header_at(word * 64 + __builtin_ctzll(bits));
+            if(header->signature == Signature::EndEdge)
+                continue;
+            // A corrupted size may point anywhere
+            auto next = header->next();
+            if(!header->valid_signature() || (char*)(next + 1) > end(m_data) || !is_header(next))
+            {
+                valid = false;
+                continue;
+            }
+            if(header->signature == Signature::Used && header->size > 0)
+                callback({ header + 1, header->size, HeapRegion::Heap }, context);
+        }
+    }
+    return valid;
+}
+
+void HeapBlock::dump()
+{
+    HeapHeader* header = reinterpret_cast<HeapHeader*>(m_data);
+
+    printf(" :: Heap %p; next = %p, largest free <= %u\n", this, m_next, m_largest_free);
+    while(header)
+    {
+        if(!header->valid_signature())
+        {
+            // The rest of the block can't be trusted
+            printf("(corrupted at %p, signature is %x)\n", header, (u32)header->signature);
+            break;
+        }
+
+        printf("    * %zu +%u (prev +%u)",
+            (reinterpret_cast<size_t>(header) - reinterpret_cast<size_t>(m_data)),
+            header->size, header->prev_size);
+        if(header->next())
+            printf(" next: %lu (%p)", reinterpret_cast<size_t>(header->next()) - reinterpret_cast<size_t>(m_data), header->next());
+
+        if(header->available())
+            printf(" (available)");
+        if(header->freed())
+            printf(" (freed)");
+        printf(" ");
+        header->print_signature();
+
+        printf(" :: addr: %p\n", (header + 1));
+        header = header->next();
+    }
+    if(m_next)
+        m_next->dump();
+}
+
+// Small allocations are rounded up to one of these size classes. Regions of
+// exactly a class size are not merged back on free, but kept in a per-class
+// LIFO list, so that small alloc/free pairs don't need to walk headers.
+constexpr size_t size_classes[] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024,
+};
+constexpr size_t size_class_count = sizeof(size_classes) / sizeof(size_classes[0]);
+constexpr size_t max_size_class = size_classes[size_class_count - 1];
+
+// Upper bound of bytes kept in a single free list; everything above that
+// goes back to its HeapBlock to be merged.
+constexpr size_t size_class_cache_bytes = heap_block_size;
+
+// Maps (size + 7) / 8 to the index of the smallest class that fits size.
+struct SizeClassLookup
+{
+    unsigned char index[max_size_class / 8 + 1] {};
+
+    constexpr SizeClassLookup()
+    {
+        size_t cls = 0;
+        for(size_t i = 0; i < sizeof(index); i++)
+        {
+            while(size_classes[cls] < i * 8)
+                cls++;
+            index[i] = cls;
+        }
+    }
+};
+
+constexpr SizeClassLookup size_class_lookup;
+
+size_t size_class_of(size_t size)
+{
+    return size_class_lookup.index[(size + 7) / 8];
+}
+
+// Index of the class of a region of `size` bytes, or size_class_count if
+// its size is not exactly a class size.
+size_t exact_size_class_of(size_t size)
+{
+    if(size > max_size_class)
+        return size_class_count;
+    auto cls = size_class_of(size);
+    return size_classes[cls] == size ? cls : size_class_count;
+}
+
+// Classes up to this size are allocated from slabs instead of heap blocks
+constexpr size_t max_slab_object_size = 256;
+
+bool is_slab_class(size_t cls)
+{
+    return size_classes[cls] <= max_slab_object_size;
+}
+
+// A block dedicated to objects of a single size class. Objects have no
+// headers; which of them are free is kept in a bitmap, so the overhead is
+// a bit per object (plus one for remote frees).
+class SlabBlock
+{
+public:
+    // Take a new slab from the block pool of the arena
+    static SlabBlock* create(size_t cls, Arena* arena);
+    // Give the slab back to the pool
+    void destroy();
+
+    static SlabBlock* containing(void* addr)
+    {
+        return static_cast<SlabBlock*>(block_of(addr));
+    }
+
+    Arena* arena() const { return m_arena; }
+    size_t size_class() const { return m_size_class; }
+    size_t object_size() const { return size_classes[m_size_class]; }
+    size_t capacity() const { return sizeof(m_data) / object_size(); }
+    size_t free_count() const { return m_free_count; }
+    bool full() const { return m_free_count == 0; }
+    bool empty() const { return m_free_count == capacity(); }
+
+    // Both require the slab not to be full
+    void* alloc();
+    void free(void* addr);
+
+    // Mark the object as queued for a remote free (this may be called
+    // without the arena lock), and unmark it before actually freeing it
+    void mark_remote_freed(void* addr);
+    void clear_remote_freed(void* addr);
+
+    // Slabs are kept in lists by their arena
+    void link(SlabBlock*& head);
+    void unlink(SlabBlock*& head);
+    SlabBlock* next() const { return m_next; }
+
+    // Calls the callback for the allocated objects
+    void walk(HeapWalkCallback callback, void* context);
+    void dump();
+
+private:
+    SlabBlock(size_t cls, Arena* arena);
+
+    size_t index_of(void* addr, char const* caller);
+
+    static constexpr size_t bitmap_words = (heap_block_size / size_classes[0] + 63) / 64;
+    static constexpr size_t metadata_size = (sizeof(void*) * 6 + sizeof(u64) * bitmap_words * 2 + min_align - 1) & ~(min_align - 1);
+
+    BlockKind m_kind { BlockKind::Slab };
+    u32 m_size_class {};
+    Arena* m_arena {};
+    SlabBlock* m_prev {};
+    SlabBlock* m_next {};
+    u32 m_free_count {};
+    u32 m_first_free_word {}; // No free object is in the words before
+    u32 m_used_count {};      // Objects from this index on were never handed out
+    u64 m_free[bitmap_words] {};
+    u64 m_remote_freed[bitmap_words] {};
+    alignas(min_align) char m_data[heap_block_size - metadata_size];
+};
+
+static_assert(sizeof(SlabBlock) == heap_block_size);
+
+SlabBlock::SlabBlock(size_t cls, Arena* arena)
+: m_size_class(cls)
+, m_arena(arena)
+{
+    count(g_counters.slabs);
+    m_free_count = capacity();
+    for(size_t i = 0; i < m_free_count; i++)
+        m_free[i / 64] |= (u64)1 << (i % 64);
+}
+
+SlabBlock* SlabBlock::create(size_t cls, Arena* arena)
+{
+    bool zeroed;
+    auto memory = block_pool_of(arena).take(zeroed);
+    return new(memory) SlabBlock{cls, arena};
+}
+
+void SlabBlock::destroy()
+{
+    uncount(g_counters.slabs);
+    block_pool_of(m_arena).put(this);
+}
+
+size_t SlabBlock::index_of(void* addr, char const* caller)
+{
+    size_t offset = static_cast<char*>(addr) - m_data;
+    if constexpr(HeapPolicy::check_headers)
+    {
+        if(addr < m_data || offset % object_size() != 0 || offset / object_size() >= capacity())
+        {
+            printf("%s: %p is not an object of slab %p\n", caller, addr, this);
+            abort();
+        }
+    }
+    return offset / object_size();
+}
+
+void* SlabBlock::alloc()
+{
+    assert(!full());
+    size_t word = m_first_free_word;
+    while(!m_free[word])
+        word++;
+    m_first_free_word = word;
+
+    size_t index = word * 64 + __builtin_ctzll(m_free[word]);
+    m_free[word] &= m_free[word] - 1;
+    m_free_count--;
+    auto object = m_data + index * object_size();
+    // The lowest free object is taken, so this is the next never used one:
+    // objects are scrubbed one at a time instead of the whole slab up front
+    if(index == m_used_count)
+    {
+        m_used_count++;
+        if constexpr(HeapPolicy::scrub)
+            memset(object, 0xef, object_size());
+    }
+    return object;
+}
+
+void SlabBlock::free(void* addr)
+{
+    auto index = index_of(addr, "SlabBlock::free");
+    auto bit = (u64)1 << (index % 64);
+    if(m_free[index / 64] & bit)
+    {
+        printf("SlabBlock::free: Block already freed\n");
+        abort();
+    }
+    m_free[index / 64] |= bit;
+    m_free_count++;
+    m_first_free_word = min<u32>(m_first_free_word, index / 64);
+}
+
+void SlabBlock::mark_remote_freed(void* addr)
+{
+    auto index = index_of(addr, "SlabBlock::mark_remote_freed");
+    auto bit = (u64)1 << (index % 64);
+    if(__atomic_fetch_or(&m_remote_freed[index / 64], bit, __ATOMIC_RELAXED) & bit)
+    {
+        printf("Arena::free_remote: Block already freed\n");
+        abort();
+    }
+}
+
+void SlabBlock::clear_remote_freed(void* addr)
+{
+    auto index = index_of(addr, "SlabBlock::clear_remote_freed");
+    __atomic_fetch_and(&m_remote_freed[index / 64], ~((u64)1 << (index % 64)), __ATOMIC_RELAXED);
+}
+
+void SlabBlock::link(SlabBlock*& head)
+{
+    m_prev = nullptr;
+    m_next = head;
+    if(head)
+        head->m_prev = this;
+    head = this;
+}
+
+void SlabBlock::unlink(SlabBlock*& head)
+{
+    if(m_prev)
+        m_prev->m_next = m_next;
+    else
+        head = m_next;
+    if(m_next)
+        m_next->m_prev = m_prev;
+    m_prev = m_next = nullptr;
+}
+
+void SlabBlock::walk(HeapWalkCallback callback, void* context)
+{
+    for(size_t index = 0; index < capacity(); index++)
+    {
+        if(!(m_free[index / 64] & (u64)1 << (index % 64)))
+            callback({ m_data + index * object_size(), object_size(), HeapRegion::Slab }, context);
+    }
+}
+
+void SlabBlock::dump()
+{
+    printf(" :: Slab %p; %zu bytes objects, %u/%zu free; next = %p\n", this, object_size(), m_free_count, capacity(), m_next);
+}
+
+Arena* arena_of(void* addr)
+{
+    if(block_kind_of(addr) == BlockKind::Slab)
+        return SlabBlock::containing(addr)->arena();
+    return HeapBlock::containing(addr)->arena();
+}
+
+struct FreeListNode
+{
+    FreeListNode* next;
+};
+
+class SizeClassFreeLists
+{
+public:
+    void* pop(size_t cls);
+    bool push(HeapHeader* header);
+
+private:
+    FreeListNode* m_heads[size_class_count] {};
+    size_t m_counts[size_class_count] {};
+};
+
+void* SizeClassFreeLists::pop(size_t cls)
+{
+    auto node = m_heads[cls];
+    if(!node)
+        return nullptr;
+
+    auto header = reinterpret_cast<HeapHeader*>(node) - 1;
+    if(HeapPolicy::check_headers && (header->signature != Signature::Cached || header->size != size_classes[cls]))
+    {
+        printf("SizeClassFreeLists::pop: Invalid cached header %x (addr=%p)\n", (u32)header->signature, header);
+        abort();
+    }
+
+    m_heads[cls] = node->next;
+    m_counts[cls]--;
+    header->signature = Signature::Used;
+    return node;
+}
+
+bool SizeClassFreeLists::push(HeapHeader* header)
+{
+    // Only regions of exactly a class size can be handed out again as-is
+    // Slab classes are never allocated from the free lists
+    auto cls = exact_size_class_of(header->size);
+    if(cls == size_class_count || is_slab_class(cls))
+        return false;
+    if((m_counts[cls] + 1) * size_classes[cls] > size_class_cache_bytes)
+        return false;
+
+    header->signature = Signature::Cached;
+    auto node = reinterpret_cast<FreeListNode*>(header + 1);
+    node->next = m_heads[cls];
+    m_heads[cls] = node;
+    m_counts[cls]++;
+    return true;
+}
+
+// An independent part of the heap: a block list, slabs and the size class
+// free lists that thread caches are refilled from and flushed to. All of it
+// (including every header in its blocks) is only touched with m_lock held.
+// Threads are assigned to arenas round-robin, so that they don't all contend
+// on the same lock and block list.
+class Arena
+{
+public:
+    // The arena of the calling thread
+    static Arena& current();
+
+    void* alloc(size_t size, size_t align, bool zero = false);
+    void free(void* addr);
+    bool resize(void* addr, size_t size);
+
+    // Like alloc() and free() for many regions, under a single lock;
+    // `size` must fit in a heap block
+    void alloc_batch(size_t size, size_t count, void** addrs);
+    void free_batch(void* const* addrs, size_t count);
+
+    // Whole blocks, for bump arenas
+    void* take_block();
+    void put_block(void* block);
+
+    // Free a region from a thread of another arena, without taking the lock.
+    // The region is actually freed on the next alloc in this arena.
+    void free_remote(void* addr);
+
+    // Move `count` regions of class `cls` from the arena to `head`, or back
+    void refill(size_t cls, size_t count, void** head);
+    void flush(size_t cls, void* head);
+
+    void dump();
+    // Calls the callback for allocations in heap blocks and slabs
+    bool walk(HeapWalkCallback callback, void* context);
+
+    // Can be read without the lock
+    FreeRegions const& free_regions() const { return m_free_regions; }
+
+    // NUMA node that the memory of the arena is bound to, and that its
+    // threads run on (at least when they first allocated)
+    u32 node() const { return m_node; }
+    void set_node(u32 node);
+
+private:
+    HeapBlock& first_block();
+    void alloc_batch_locked(size_t size, size_t count, void** addrs);
+    void free_locked(void* addr);
+    void drain_remote_frees();
+
+    void* alloc_from_slab(size_t cls);
+    void free_to_slab(SlabBlock* slab, void* addr);
+
+    Mutex m_lock;
+    FreeListNode* m_remote_frees {};
+    bool m_initialized { false };
+    SizeClassFreeLists m_free_lists;
+    // Slabs with free objects, and full slabs, of every slab class
+    SlabBlock* m_slabs[size_class_count] {};
+    SlabBlock* m_full_slabs[size_class_count] {};
+    BlockPool m_block_pool;
+    FreeRegions m_free_regions;
+    u32 m_node {};
+
+    friend BlockPool& block_pool_of(Arena* arena);
+    friend FreeRegions& free_regions_of(Arena* arena);
+};
+
+constexpr size_t max_arena_count = 64;
+
+Arena g_arenas[max_arena_count];
+
+// This is a hack to enable lazy-construction of heap also allowing to
+// call member functions of HeapBlock
+alignas(sizeof(HeapBlock)) char g_heap_data[max_arena_count][sizeof(HeapBlock)];
+
+BlockPool& block_pool_of(Arena* arena)
+{
+    return arena->m_block_pool;
+}
+
+FreeRegions& free_regions_of(Arena* arena)
+{
+    return arena->m_free_regions;
+}
+
+void Arena::set_node(u32 node)
+{
+    m_node = node;
+    m_block_pool.set_node(node);
+}
+
+HeapBlock& Arena::first_block()
+{
+    auto storage = g_heap_data[this - g_arenas];
+    if(!m_initialized)
+    {
+        bind_to_node(storage, sizeof(HeapBlock), m_node);
+        new (storage) HeapBlock{nullptr, this};
+        m_initialized = true;
+    }
+    return *reinterpret_cast<HeapBlock*>(storage);
+}
+
+void* Arena::alloc(size_t size, size_t align, bool zero)
+{
+    Locker lock(m_lock);
+    drain_remote_frees();
+    if(size <= max_size_class && align <= min_align)
+    {
+        auto cls = size_class_of(size);
+        if(is_slab_class(cls))
+        {
+            auto addr = alloc_from_slab(cls);
+            if(zero)
+                memset(addr, 0, size);
+            return addr;
+        }
+        if(auto addr = m_free_lists.pop(cls))
+        {
+            if(zero)
+                memset(addr, 0, size);
+            return addr;
+        }
+        size = size_classes[cls];
+    }
+    return first_block().alloc(size, align, zero);
+}
+
+void Arena::free(void* addr)
+{
+    Locker lock(m_lock);
+    free_locked(addr);
+}
+
+void Arena::alloc_batch(size_t size, size_t count, void** addrs)
+{
+    Locker lock(m_lock);
+    drain_remote_frees();
+    alloc_batch_locked(size, count, addrs);
+}
+
+void Arena::alloc_batch_locked(size_t size, size_t count, void** addrs)
+{
+    if(size <= max_size_class)
+    {
+        auto cls = size_class_of(size);
+        if(is_slab_class(cls))
+        {
+            for(size_t i = 0; i < count; i++)
+                addrs[i] = alloc_from_slab(cls);
+            return;
+        }
+        size = size_classes[cls];
+        while(count && (*addrs = m_free_lists.pop(cls)))
+        {
+            addrs++;
+            count--;
+        }
+    }
+    if(count)
+        first_block().alloc_batch(size, count, addrs);
+}
+
+void* Arena::take_block()
+{
+    Locker lock(m_lock);
+    bool zeroed;
+    return m_block_pool.take(zeroed);
+}
+
+void Arena::put_block(void* block)
+{
+    Locker lock(m_lock);
+    m_block_pool.put(block);
+}
+
+void Arena::free_batch(void* const* addrs, size_t count)
+{
+    Locker lock(m_lock);
+    for(size_t i = 0; i < count; i++)
+        free_locked(addrs[i]);
+}
+
+void Arena::free_locked(void* addr)
+{
+    if(block_kind_of(addr) == BlockKind::Slab)
+    {
+        free_to_slab(SlabBlock::containing(addr), addr);
+        return;
+    }
+
+    if(!m_initialized)
+    {
+        printf("my_free: Heap is not initialized\n");
+        abort();
+    }
+
+    auto header = reinterpret_cast<HeapHeader*>(addr) - 1;
+    if(header->signature == Signature::Used && m_free_lists.push(header))
+        return;
+    HeapBlock::containing(addr)->free(addr);
+}
+
+bool Arena::resize(void* addr, size_t size)
+{
+    Locker lock(m_lock);
+    return HeapBlock::containing(addr)->resize(addr, size);
+}
+
+void* Arena::alloc_from_slab(size_t cls)
+{
+    auto slab = m_slabs[cls];
+    if(!slab)
+    {
+        slab = SlabBlock::create(cls, this);
+        slab->link(m_slabs[cls]);
+    }
+
+    auto addr = slab->alloc();
+    if(slab->full())
+    {
+        slab->unlink(m_slabs[cls]);
+        slab->link(m_full_slabs[cls]);
+    }
+    return addr;
+}
+
+void Arena::free_to_slab(SlabBlock* slab, void* addr)
+{
+    auto cls = slab->size_class();
+    if(slab->full())
+    {
+        slab->unlink(m_full_slabs[cls]);
+        slab->link(m_slabs[cls]);
+    }
+    slab->free(addr);
+
+    // Give empty slabs back to the OS, except the last one with free objects,
+    // so that alternating alloc/free doesn't map and unmap a slab every time
+    if(slab->empty() && (m_slabs[cls] != slab || slab->next()))
+    {
+        slab->unlink(m_slabs[cls]);
+        slab->destroy();
+    }
+}
+
+void Arena::free_remote(void* addr)
+{
+    if(block_kind_of(addr) == BlockKind::Slab)
+        SlabBlock::containing(addr)->mark_remote_freed(addr);
+    else
+    {
+        auto header = reinterpret_cast<HeapHeader*>(addr) - 1;
+        if(header->flags & HeapHeader::RemoteFreed)
+        {
+            printf("Arena::free_remote: Block already freed\n");
+            abort();
+        }
+        header->flags |= HeapHeader::RemoteFreed;
+    }
+
+    // Lock-free push; there are many producers, but only one consumer at a
+    // time (the one holding m_lock), which takes the whole list at once.
+    auto node = static_cast<FreeListNode*>(addr);
+    node->next = __atomic_load_n(&m_remote_frees, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&m_remote_frees, &node->next, node, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+void Arena::drain_remote_frees()
+{
+    if(!__atomic_load_n(&m_remote_frees, __ATOMIC_RELAXED))
+        return;
+
+    auto node = __atomic_exchange_n(&m_remote_frees, nullptr, __ATOMIC_ACQUIRE);
+    while(node)
+    {
+        auto next = node->next;
+        if(block_kind_of(node) == BlockKind::Slab)
+            SlabBlock::containing(node)->clear_remote_freed(node);
+        else
+            (reinterpret_cast<HeapHeader*>(node) - 1)->flags &= ~HeapHeader::RemoteFreed;
+        free_locked(node);
+        node = next;
+    }
+}
+
+void Arena::refill(size_t cls, size_t count, void** head)
+{
+    Locker lock(m_lock);
+    drain_remote_frees();
+    while(count)
+    {
+        void* addrs[64];
+        auto batch = min(count, sizeof(addrs) / sizeof(addrs[0]));
+        alloc_batch_locked(size_classes[cls], batch, addrs);
+        for(size_t i = 0; i < batch; i++)
+        {
+            *reinterpret_cast<void**>(addrs[i]) = *head;
+            *head = addrs[i];
+        }
+        count -= batch;
+    }
+}
+
+void Arena::flush(size_t cls, void* head)
+{
+    Locker lock(m_lock);
+    while(head)
+    {
+        auto addr = head;
+        head = *reinterpret_cast<void**>(addr);
+
+        if(block_kind_of(addr) == BlockKind::Slab)
+        {
+            free_to_slab(SlabBlock::containing(addr), addr);
+            continue;
+        }
+
+        auto header = reinterpret_cast<HeapHeader*>(addr) - 1;
+        if(HeapPolicy::check_headers && (header->signature != Signature::Used || header->size != size_classes[cls]))
+        {
+            printf("Arena::flush: Invalid header signature %x (addr=%p)\n", (u32)header->signature, header);
+            abort();
+        }
+        if(!m_free_lists.push(header))
+            HeapBlock::containing(addr)->free(addr);
+    }
+}
+
+void Arena::dump()
+{
+    Locker lock(m_lock);
+    bool has_slabs = false;
+    for(size_t cls = 0; cls < size_class_count; cls++)
+        has_slabs |= m_slabs[cls] || m_full_slabs[cls];
+    if(!m_initialized && !has_slabs)
+        return;
+
+    printf(" :: Arena %zu\n", this - g_arenas);
+    if(m_initialized)
+        first_block().dump();
+    for(size_t cls = 0; cls < size_class_count; cls++)
+    {
+        for(auto slab = m_slabs[cls]; slab; slab = slab->next())
+            slab->dump();
+        for(auto slab = m_full_slabs[cls]; slab; slab = slab->next())
+            slab->dump();
+    }
+}
+
+bool Arena::walk(HeapWalkCallback callback, void* context)
+{
+    Locker lock(m_lock);
+    drain_remote_frees();
+    bool valid = true;
+    if(m_initialized)
+    {
+        for(auto block = &first_block(); block; block = block->next())
+            valid &= block->walk(callback, context);
+    }
+    for(size_t cls = 0; cls < size_class_count; cls++)
+    {
+        for(auto slab = m_slabs[cls]; slab; slab = slab->next())
+            slab->walk(callback, context);
+        for(auto slab = m_full_slabs[cls]; slab; slab = slab->next())
+            slab->walk(callback, context);
+    }
+    return valid;
+}
+
+// Allocation counters of a thread. Only the thread itself changes them, but
+// my_heap_stats() reads them from other threads, hence the atomic stores.
+struct ThreadStats
+{
+    // Per size class; the last one counts all bigger allocations
+    size_t allocs[size_class_count + 1];
+    size_t frees[size_class_count + 1];
+    size_t bytes_allocated;
+    size_t bytes_freed;
+
+    static void add(size_t& counter, size_t value)
+    {
+        __atomic_store_n(&counter, counter + value, __ATOMIC_RELAXED);
+    }
+
+    static size_t bucket_of(size_t size)
+    {
+        return size <= max_size_class ? size_class_of(size) : size_class_count;
+    }
+
+    void record_alloc(size_t size)
+    {
+        add(allocs[bucket_of(size)], 1);
+        add(bytes_allocated, size);
+    }
+
+    void record_free(size_t size)
+    {
+        add(frees[bucket_of(size)], 1);
+        add(bytes_freed, size);
+    }
+
+    void record_resize(size_t old_size, size_t new_size)
+    {
+        if(new_size > old_size)
+            add(bytes_allocated, new_size - old_size);
+        else
+            add(bytes_freed, old_size - new_size);
+    }
+
+    void add_to(ThreadStats& total) const
+    {
+        for(size_t i = 0; i <= size_class_count; i++)
+        {
+            total.allocs[i] += __atomic_load_n(&allocs[i], __ATOMIC_RELAXED);
+            total.frees[i] += __atomic_load_n(&frees[i], __ATOMIC_RELAXED);
+        }
+        total.bytes_allocated += __atomic_load_n(&bytes_allocated, __ATOMIC_RELAXED);
+        total.bytes_freed += __atomic_load_n(&bytes_freed, __ATOMIC_RELAXED);
+    }
+};
+
+// Small regions freed by a thread are kept in its own cache first, so that
+// the common alloc/free path doesn't need to take the arena lock. The caches
+// are refilled from and flushed to the arena in batches.
+//
+// Regions in the thread cache keep their USED header (headers may only be
+// written with the arena lock held); instead, the payload stores the owning
+// cache, which is how double frees are detected here.
+class ThreadCache
+{
+public:
+    void* alloc(size_t cls);
+    void free(void* addr, size_t cls);
+    void flush();
+
+    // Take up to `count` cached regions, without refilling the cache;
+    // returns how many were taken
+    size_t take(size_t cls, size_t count, void** addrs);
+
+    Arena& arena();
+
+    // False when the thread is exiting and the cache was already flushed
+    bool usable() const { return !m_destroyed; }
+
+    // Statistics of the thread (usable sizes)
+    void record_alloc(size_t size);
+    void record_free(size_t size);
+    void record_resize(size_t old_size, size_t new_size);
+
+    // Sum of statistics of all threads, also the exited ones
+    static void total_stats(ThreadStats& total);
+
+    // True if the allocation should be sampled by the heap profiler
+    bool sample(size_t size)
+    {
+        m_bytes_until_sample -= (ptrdiff_t)size;
+        return m_bytes_until_sample < 0 && next_sample();
+    }
+
+    // True if the allocation should be placed in a guarded slot
+    bool guard()
+    {
+        return --m_allocs_until_guard < 0 && next_guard();
+    }
+
+private:
+    struct Entry
+    {
+        Entry* next;
+        ThreadCache* owner;
+    };
+    static_assert(size_classes[0] >= sizeof(Entry));
+
+    static size_t capacity(size_t cls)
+    {
+        return max<size_t>(thread_cache_bytes / size_classes[cls], 2);
+    }
+
+    // Register the flush on thread exit, and the thread in the list of
+    // threads for statistics
+    void register_thread();
+
+    // Runs the update on the thread statistics, or the ones of exited
+    // threads if this one is exiting
+    template<class F>
+    void update_stats(F update);
+
+    // Draws the distance to the next sample; false if sampling was just
+    // (re)started or is disabled
+    bool next_sample();
+    // The same for guarded allocations
+    bool next_guard();
+    u64 next_random();
+
+    static constexpr size_t thread_cache_bytes = 8 * 1024;
+
+    // How often a thread checks if sampling was enabled
+    static constexpr ptrdiff_t sample_recheck_bytes = 1 << 20;
+    static constexpr ptrdiff_t guard_recheck_allocs = 1 << 12;
+
+    Entry* m_heads[size_class_count] {};
+    size_t m_counts[size_class_count] {};
+    Arena* m_arena {};
+    bool m_registered {};
+    bool m_destroyed {};
+    ThreadStats m_stats {};
+    ThreadCache* m_prev_thread {};
+    ThreadCache* m_next_thread {};
+    ptrdiff_t m_bytes_until_sample {};
+    bool m_sampling {};
+    ptrdiff_t m_allocs_until_guard {};
+    bool m_guarding {};
+    u64 m_random {};
+};
+
+thread_local ThreadCache t_thread_cache;
+
+// Threads that use the heap, and the statistics of exited ones
+Mutex g_threads_lock;
+ThreadCache* g_threads;
+ThreadStats g_exited_thread_stats;
+
+// One arena per CPU should make contention rare enough. Arena i is on node
+// g_numa_nodes[i % g_numa_node_count].
+size_t g_arena_count;
+size_t g_next_arena[max_numa_nodes];
+pthread_once_t g_arenas_once = PTHREAD_ONCE_INIT;
+
+void setup_arenas()
+{
+    size_t count = max<long>(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    g_arena_count = min(count, max_arena_count);
+    read_numa_nodes();
+    for(size_t i = 0; i < g_arena_count; i++)
+        g_arenas[i].set_node(g_numa_nodes[i % g_numa_node_count]);
+}
+
+Arena& ThreadCache::arena()
+{
+    if(!m_arena)
+    {
+        // Threads are assigned round-robin to the arenas of the node they
+        // run on, so pinned threads keep their memory local
+        pthread_once(&g_arenas_once, setup_arenas);
+        size_t nodes = min(g_numa_node_count, g_arena_count);
+        size_t first = 0;
+        if(nodes > 1)
+        {
+            auto node = current_numa_node();
+            while(first < nodes - 1 && g_numa_nodes[first] != node)
+                first++;
+        }
+        size_t node_arenas = (g_arena_count - first + nodes - 1) / nodes;
+        m_arena = &g_arenas[first + __atomic_fetch_add(&g_next_arena[first], 1, __ATOMIC_RELAXED) % node_arenas * nodes];
+    }
+    return *m_arena;
+}
+
+Arena& Arena::current()
+{
+    return t_thread_cache.arena();
+}
+
+pthread_key_t g_thread_cache_key;
+pthread_once_t g_thread_cache_key_once = PTHREAD_ONCE_INIT;
+
+void ThreadCache::register_thread()
+{
+    if(m_registered)
+        return;
+    pthread_once(&g_thread_cache_key_once, []() {
+        pthread_key_create(&g_thread_cache_key, [](void* cache) {
+            auto thread_cache = static_cast<ThreadCache*>(cache);
+            thread_cache->flush();
+
+            Locker lock(g_threads_lock);
+            thread_cache->m_stats.add_to(g_exited_thread_stats);
+            if(thread_cache->m_prev_thread)
+                thread_cache->m_prev_thread->m_next_thread = thread_cache->m_next_thread;
+            else
+                g_threads = thread_cache->m_next_thread;
+            if(thread_cache->m_next_thread)
+                thread_cache->m_next_thread->m_prev_thread = thread_cache->m_prev_thread;
+            thread_cache->m_destroyed = true;
+        });
+    });
+    pthread_setspecific(g_thread_cache_key, this);
+
+    Locker lock(g_threads_lock);
+    m_next_thread = g_threads;
+    if(g_threads)
+        g_threads->m_prev_thread = this;
+    g_threads = this;
+    m_registered = true;
+}
+
+template<class F>
+void ThreadCache::update_stats(F update)
+{
+    if(m_destroyed)
+    {
+        Locker lock(g_threads_lock);
+        update(g_exited_thread_stats);
+        return;
+    }
+    register_thread();
+    update(m_stats);
+}
+
+void ThreadCache::record_alloc(size_t size)
+{
+    update_stats([&](ThreadStats& stats) { stats.record_alloc(size); });
+}
+
+void ThreadCache::record_free(size_t size)
+{
+    update_stats([&](ThreadStats& stats) { stats.record_free(size); });
+}
+
+void ThreadCache::record_resize(size_t old_size, size_t new_size)
+{
+    update_stats([&](ThreadStats& stats) { stats.record_resize(old_size, new_size); });
+}
+
+void ThreadCache::total_stats(ThreadStats& total)
+{
+    Locker lock(g_threads_lock);
+    g_exited_thread_stats.add_to(total);
+    for(auto thread = g_threads; thread; thread = thread->m_next_thread)
+        thread->m_stats.add_to(total);
+}
+
+// Mean distance between samples of the heap profiler, in allocated bytes;
+// 0 disables sampling
+size_t g_sample_interval;
+
+bool ThreadCache::next_sample()
+{
+    auto interval = __atomic_load_n(&g_sample_interval, __ATOMIC_RELAXED);
+    if(!interval)
+    {
+        m_sampling = false;
+        m_bytes_until_sample = sample_recheck_bytes;
+        return false;
+    }
+
+    // Distances are exponentially distributed, so that every allocated byte
+    // is equally likely to be sampled (a Poisson process). Otherwise,
+    // allocation patterns with the same period would be always (or never)
+    // sampled.
+    double uniform = (next_random() >> 11) * 0x1p-53; // [0, 1)
+    // <math.h> can't be used either, it pulls in <new>
+    m_bytes_until_sample = (ptrdiff_t)(-__builtin_log(1.0 - uniform) * interval);
+
+    // The first distance is just drawn, the allocation isn't sampled yet
+    bool sampled = m_sampling;
+    m_sampling = true;
+    return sampled;
+}
+
+// Mean distance between guarded allocations, in allocations; 0 disables them
+size_t g_guard_interval;
+
+bool ThreadCache::next_guard()
+{
+    auto interval = __atomic_load_n(&g_guard_interval, __ATOMIC_RELAXED);
+    if(!interval)
+    {
+        m_guarding = false;
+        m_allocs_until_guard = guard_recheck_allocs;
+        return false;
+    }
+
+    // Uniform in [0, 2 * interval), so that periodic patterns don't matter
+    m_allocs_until_guard = next_random() % (2 * interval);
+    bool guarded = m_guarding;
+    m_guarding = true;
+    return guarded;
+}
+
+u64 ThreadCache::next_random()
+{
+    if(!m_random)
+        m_random = (uptr)this * 0x9E3779B97F4A7C15 | 1;
+    m_random ^= m_random << 13;
+    m_random ^= m_random >> 7;
+    m_random ^= m_random << 17;
+    return m_random;
+}
+
+void* ThreadCache::alloc(size_t cls)
+{
+    if(!m_heads[cls])
+    {
+        register_thread();
+        auto count = capacity(cls) / 2;
+        arena().refill(cls, count, reinterpret_cast<void**>(&m_heads[cls]));
+        m_counts[cls] += count;
+    }
+
+    auto entry = m_heads[cls];
+    m_heads[cls] = entry->next;
+    m_counts[cls]--;
+    entry->owner = nullptr;
+    return entry;
+}
+
+size_t ThreadCache::take(size_t cls, size_t count, void** addrs)
+{
+    size_t taken = 0;
+    for(; taken < count && m_heads[cls]; taken++)
+    {
+        auto entry = m_heads[cls];
+        m_heads[cls] = entry->next;
+        entry->owner = nullptr;
+        addrs[taken] = entry;
+    }
+    m_counts[cls] -= taken;
+    return taken;
+}
+
+void ThreadCache::free(void* addr, size_t cls)
+{
+    // Regions from other arenas go straight back to them, so that flushing
+    // can give the whole list to our arena
+    auto owner = arena_of(addr);
+    if(owner != &arena())
+    {
+        owner->free_remote(addr);
+        return;
+    }
+
+    auto entry = static_cast<Entry*>(addr);
+    if(HeapPolicy::check_headers && entry->owner == this)
+    {
+        // This may also be just user data, make sure
+        for(auto it = m_heads[cls]; it; it = it->next)
+        {
+            if(it == entry)
+            {
+                printf("ThreadCache::free: Block already freed\n");
+                abort();
+            }
+        }
+    }
+
+    if(m_counts[cls] >= capacity(cls))
+    {
+        // Give back the older half of the list
+        auto keep = capacity(cls) / 2;
+        auto last_kept = m_heads[cls];
+        for(size_t i = 1; i < keep; i++)
+            last_kept = last_kept->next;
+        arena().flush(cls, last_kept->next);
+        last_kept->next = nullptr;
+        m_counts[cls] = keep;
+    }
+
+    entry->next = m_heads[cls];
+    entry->owner = this;
+    m_heads[cls] = entry;
+    m_counts[cls]++;
+}
+
+void ThreadCache::flush()
+{
+    for(size_t cls = 0; cls < size_class_count; cls++)
+    {
+        if(m_heads[cls])
+            arena().flush(cls, m_heads[cls]);
+        m_heads[cls] = nullptr;
+        m_counts[cls] = 0;
+    }
+}
+
+size_t page_size()
+{
+    static size_t size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+struct ProfileBucket;
+
+// Start of a big block mapping. Unlike HeapHeader, it is not right before
+// the payload, and sizes are 64-bit, so big blocks can be of any size.
+struct BigBlockHeader
+{
+    BlockKind kind { BlockKind::Big };
+    u32 flags {};
+    size_t size {};           // Size of the whole mapping
+    size_t payload_offset {}; // Distance from the start of the mapping to the payload
+    ProfileBucket* bucket {}; // Stack of a sampled allocation
+    size_t sampled_size {};   // Requested size of a sampled allocation
+    BigBlockHeader* prev_live {};
+    BigBlockHeader* next_live {};
+
+    enum Flags : u32
+    {
+        HugeTlb = 1 << 0, // Backed by reserved huge pages (MAP_HUGETLB)
+        Sampled = 1 << 1, // Recorded by the heap profiler
+    };
+
+    static BigBlockHeader* containing(void* addr)
+    {
+        return static_cast<BigBlockHeader*>(block_of(addr));
+    }
+
+    void* payload() { return (char*)this + payload_offset; }
+    size_t usable_size() const { return size - payload_offset; }
+};
+
+// A power of 2, so that it is aligned to smaller alignments too
+constexpr size_t big_block_min_payload_offset = min_align * 4;
+
+// The payload must fit before the end of the first block
+static_assert(sizeof(BigBlockHeader) <= big_block_min_payload_offset);
+
+// Live big blocks, so that they can be walked
+class BigBlockRegistry
+{
+public:
+    void add(BigBlockHeader* header);
+    void remove(BigBlockHeader* header);
+    void walk(HeapWalkCallback callback, void* context);
+
+private:
+    Mutex m_lock;
+    BigBlockHeader* m_head {};
+};
+
+BigBlockRegistry g_big_blocks;
+
+void BigBlockRegistry::add(BigBlockHeader* header)
+{
+    Locker lock(m_lock);
+    header->prev_live = nullptr;
+    header->next_live = m_head;
+    if(m_head)
+        m_head->prev_live = header;
+    m_head = header;
+}
+
+void BigBlockRegistry::remove(BigBlockHeader* header)
+{
+    Locker lock(m_lock);
+    if(header->prev_live)
+        header->prev_live->next_live = header->next_live;
+    else
+        m_head = header->next_live;
+    if(header->next_live)
+        header->next_live->prev_live = header->prev_live;
+}
+
+void BigBlockRegistry::walk(HeapWalkCallback callback, void* context)
+{
+    Locker lock(m_lock);
+    for(auto header = m_head; header; header = header->next_live)
+        callback({ header->payload(), header->usable_size(), HeapRegion::Big }, context);
+}
+
+// Freed big blocks are kept for reuse, so that repeated big allocations
+// don't map and unmap memory (and fault its pages in) every time
+constexpr size_t big_block_cache_entries = 16;
+constexpr size_t big_block_cache_max_block_size = 32 << 20;
+constexpr size_t big_block_cache_bytes = 128 << 20;
+// A cached block is reused for an allocation of at least this part of it
+constexpr size_t big_block_cache_min_fill = 4; // 3/4
+
+// Sizes above this would overflow when rounded up to pages (mappings this
+// big can't succeed anyway)
+constexpr size_t max_big_block_size = ~(size_t)0 / 2;
+
+// Big blocks of at least this size are backed by huge pages, to reduce TLB
+// misses. Transparent huge pages are requested with madvise(); MAP_HUGETLB
+// needs huge pages reserved by the system (vm.nr_hugepages), so it is only
+// tried when enabled.
+constexpr size_t huge_page_size = 2 << 20;
+constexpr size_t huge_page_threshold = 4 << 20;
+constexpr bool use_hugetlb = false;
+
+class BigBlockCache
+{
+public:
+    // Take a cached mapping of at least `size` bytes (but not much more);
+    // `size` and `flags` are set to the ones of the mapping
+    void* take(size_t& size, u32& flags);
+    // False if the mapping is not cached, it should be unmapped then
+    bool put(void* memory, size_t size, u32 flags);
+
+private:
+    struct Entry
+    {
+        void* memory;
+        size_t size;
+        u32 flags;
+    };
+
+    void remove(size_t index);
+
+    Mutex m_lock;
+    // Oldest first
+    Entry m_entries[big_block_cache_entries] {};
+    size_t m_count {};
+    size_t m_bytes {};
+};
+
+BigBlockCache g_big_block_cache;
+
+void BigBlockCache::remove(size_t index)
+{
+    m_bytes -= m_entries[index].size;
+    memmove(&m_entries[index], &m_entries[index + 1], (m_count - index - 1) * sizeof(Entry));
+    m_count--;
+}
+
+void* BigBlockCache::take(size_t& size, u32& flags)
+{
+    Locker lock(m_lock);
+
+    // Best fit
+    size_t best = m_count;
+    for(size_t i = 0; i < m_count; i++)
+    {
+        auto entry_size = m_entries[i].size;
+        if(entry_size >= size && size >= entry_size - entry_size / big_block_cache_min_fill
+            && (best == m_count || entry_size < m_entries[best].size))
+            best = i;
+    }
+    if(best == m_count)
+        return nullptr;
+
+    auto memory = m_entries[best].memory;
+    size = m_entries[best].size;
+    flags = m_entries[best].flags;
+    remove(best);
+    return memory;
+}
+
+bool BigBlockCache::put(void* memory, size_t size, u32 flags)
+{
+    if(size > big_block_cache_max_block_size)
+        return false;
+
+    Locker lock(m_lock);
+    // Make place by evicting the oldest blocks
+    while(m_count == big_block_cache_entries || m_bytes + size > big_block_cache_bytes)
+    {
+        os_unmap(m_entries[0].memory, m_entries[0].size);
+        remove(0);
+    }
+    m_entries[m_count++] = {memory, size, flags};
+    m_bytes += size;
+    return true;
+}
+
+// Map a new big block of `size` bytes, at least block-aligned, such that
+// `result + skew` is aligned to `align`. The size is rounded up for huge pages.
+char* map_big_block(size_t& size, size_t align, size_t skew, u32& flags)
+{
+    flags = 0;
+    if(size < huge_page_threshold)
+    {
+        if(align > heap_block_size)
+            return (char*)map_aligned(size, align, skew);
+        return (char*)map_aligned(size, heap_block_size);
+    }
+
+    size = (size + huge_page_size - 1) & ~(huge_page_size - 1);
+    if(use_hugetlb && align <= heap_block_size)
+    {
+        // These are always aligned to the huge page size
+        auto memory = (char*)os_map(size, MAP_HUGETLB);
+        if(memory)
+        {
+            flags = BigBlockHeader::HugeTlb;
+            return memory;
+        }
+    }
+
+    char* memory;
+    if(align > heap_block_size)
+        memory = (char*)map_aligned(size, align, skew);
+    else
+        memory = (char*)map_aligned(size, huge_page_size);
+    if(memory)
+        madvise(memory, size, MADV_HUGEPAGE);
+    return memory;
+}
+
+// Big blocks are mapped directly from the OS, so they are zeroed, unless
+// they are reused from the cache (they are cleared then if `zero` is set).
+// Like other blocks, the mapping is aligned to heap_block_size and starts
+// with its kind (as a part of BigBlockHeader). The payload is at most
+// heap_block_size bytes after the start (for bigger alignments, the start
+// is placed so that this is aligned); the space between is unused.
+void* alloc_big_block(size_t size, size_t align = min_align, bool zero = false)
+{
+    //printf("my_malloc: Too big size: %zu, allocating big block!\n", size);
+    size_t payload_offset = min(max(align, big_block_min_payload_offset), heap_block_size);
+    if(size > max_big_block_size)
+    {
+        printf("my_malloc: Size %zu is too big\n", size);
+        return nullptr;
+    }
+    size_t total_size = (payload_offset + size + page_size() - 1) & ~(page_size() - 1);
+
+    // Cached blocks are only aligned to heap_block_size
+    u32 flags = 0;
+    char* memory = nullptr;
+    if(align <= heap_block_size)
+        memory = (char*)g_big_block_cache.take(total_size, flags);
+    if(memory)
+    {
+        if(zero)
+            memset(memory + payload_offset, 0, size);
+    }
+    else
+    {
+        memory = map_big_block(total_size, align, payload_offset, flags);
+        if(!memory)
+        {
+            perror("my_malloc: mmap");
+            return nullptr;
+        }
+        bind_to_node(memory, total_size, Arena::current().node());
+    }
+
+    auto header = new (memory) BigBlockHeader;
+    header->flags = flags;
+    header->size = total_size;
+    header->payload_offset = payload_offset;
+    g_big_blocks.add(header);
+    count(g_counters.big_blocks);
+    count(g_counters.big_block_bytes, header->usable_size());
+    return header->payload();
+}
+
+// Sampled allocations can be placed in guarded slots (like GWP-ASan), to
+// catch memory errors in production builds: a slot is a block with the
+// payload right before an inaccessible page, and another one before the
+// payload, so overflows and underflows fault right away. Freed slots are
+// made inaccessible and reused as late as possible, which catches uses
+// after free too. The faults are reported by a SIGSEGV handler.
+constexpr size_t guarded_slot_count = 64;
+constexpr size_t guarded_stack_depth = 16;
+
+// Start of a slot, in its first page (the only one that is always accessible)
+struct GuardedSlot
+{
+    BlockKind kind { BlockKind::Guarded };
+    bool live {};
+    size_t size {}; // Requested size
+    char* payload {};
+    GuardedSlot* next_free {};
+    size_t alloc_depth {};
+    size_t free_depth {};
+    void* alloc_stack[guarded_stack_depth] {};
+    void* free_stack[guarded_stack_depth] {};
+
+    static GuardedSlot* containing(void* addr)
+    {
+        return static_cast<GuardedSlot*>(block_of(addr));
+    }
+
+    // Payloads are in the pages between the guard pages
+    char* data() { return (char*)this + page_size() * 2; }
+    char* data_end() { return (char*)this + heap_block_size - page_size(); }
+    size_t usable_size() { return data_end() - payload; }
+};
+
+static_assert(sizeof(GuardedSlot) <= 4096);
+
+class GuardedPool
+{
+public:
+    // Null if the allocation doesn't fit in a slot or all of them are in use
+    void* alloc(size_t size, size_t align);
+    void free(void* addr);
+    void walk(HeapWalkCallback callback, void* context);
+    size_t live_count() const { return __atomic_load_n(&m_live_count, __ATOMIC_RELAXED); }
+
+    // Called on SIGSEGV: prints what happened if the fault is in a slot
+    void report_fault(void* addr);
+    struct sigaction const& previous_action() const { return m_previous_action; }
+
+private:
+    bool reserve();
+    GuardedSlot* slot(size_t index) { return reinterpret_cast<GuardedSlot*>(m_memory + index * heap_block_size); }
+    bool contains(void* addr) const { return (char*)addr >= m_memory && (char*)addr < m_memory + guarded_slot_count * heap_block_size; }
+
+    Mutex m_lock;
+    char* m_memory {};
+    bool m_failed {};
+    size_t m_unused_count { guarded_slot_count }; // Slots from the end that were never used
+    // Freed slots, the oldest first
+    GuardedSlot* m_free_head {};
+    GuardedSlot* m_free_tail {};
+    size_t m_live_count {};
+    struct sigaction m_previous_action {};
+};
+
+GuardedPool g_guarded_pool;
+
+void guarded_fault_handler(int signal_number, siginfo_t* info, void* context)
+{
+    g_guarded_pool.report_fault(info->si_addr);
+
+    // Let the previous handler deal with it, or the default action when
+    // the fault happens again after returning
+    auto& previous = g_guarded_pool.previous_action();
+    if(previous.sa_flags & SA_SIGINFO)
+        return previous.sa_sigaction(signal_number, info, context);
+    if(previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN)
+        return previous.sa_handler(signal_number);
+    signal(signal_number, SIG_DFL);
+}
+
+bool GuardedPool::reserve()
+{
+    // The slot needs a page for the header, two guard pages and some data
+    if(heap_block_size < page_size() * 4)
+        return false;
+    m_memory = (char*)map_aligned(guarded_slot_count * heap_block_size, heap_block_size);
+    if(!m_memory)
+    {
+        perror("my_malloc: mmap");
+        return false;
+    }
+    for(size_t i = 0; i < guarded_slot_count; i++)
+        mprotect((char*)slot(i) + page_size(), heap_block_size - page_size(), PROT_NONE);
+
+    struct sigaction action {};
+    action.sa_sigaction = guarded_fault_handler;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &m_previous_action);
+    return true;
+}
+
+void* GuardedPool::alloc(size_t size, size_t align)
+{
+    // Right-aligned, so it ends as close to the guard page as the alignment allows
+    if(size > heap_block_size - page_size() * 3 || align > page_size())
+        return nullptr;
+    size_t payload_offset = (heap_block_size - page_size() - size) & ~(align - 1);
+
+    void* stack[guarded_stack_depth];
+    size_t depth = backtrace(stack, guarded_stack_depth);
+
+    GuardedSlot* slot;
+    {
+        Locker lock(m_lock);
+        if(!m_memory && (m_failed || !(m_failed = !reserve())))
+            return nullptr;
+        if(m_unused_count)
+            slot = this->slot(guarded_slot_count - m_unused_count--);
+        else if(m_free_head)
+        {
+            slot = m_free_head;
+            m_free_head = slot->next_free;
+            if(!m_free_head)
+                m_free_tail = nullptr;
+        }
+        else
+            return nullptr;
+    }
+
+    // Freed slots are given back to the OS, so the data is zeroed
+    auto slot_start = (char*)slot;
+    mprotect(slot->data(), slot->data_end() - slot->data(), PROT_READ | PROT_WRITE);
+    new (slot) GuardedSlot;
+    slot->live = true;
+    slot->size = size;
+    slot->payload = slot_start + payload_offset;
+    slot->alloc_depth = depth;
+    memcpy(slot->alloc_stack, stack, depth * sizeof(void*));
+    if constexpr(HeapPolicy::scrub)
+        memset(slot->payload, 0xef, size);
+    __atomic_fetch_add(&m_live_count, 1, __ATOMIC_RELAXED);
+    return slot->payload;
+}
+
+void GuardedPool::free(void* addr)
+{
+    auto slot = GuardedSlot::containing(addr);
+    if(!slot->live)
+    {
+        printf("my_free: Block already freed\n");
+        abort();
+    }
+    if(addr != slot->payload)
+    {
+        printf("my_free: %p is not the payload of guarded slot %p\n", addr, slot);
+        abort();
+    }
+
+    slot->live = false;
+    slot->free_depth = backtrace(slot->free_stack, guarded_stack_depth);
+    madvise(slot->data(), slot->data_end() - slot->data(), MADV_DONTNEED);
+    mprotect(slot->data(), slot->data_end() - slot->data(), PROT_NONE);
+    __atomic_fetch_sub(&m_live_count, 1, __ATOMIC_RELAXED);
+
+    Locker lock(m_lock);
+    slot->next_free = nullptr;
+    if(m_free_tail)
+        m_free_tail->next_free = slot;
+    else
+        m_free_head = slot;
+    m_free_tail = slot;
+}
+
+void GuardedPool::walk(HeapWalkCallback callback, void* context)
+{
+    Locker lock(m_lock);
+    if(!m_memory)
+        return;
+    for(size_t i = 0; i < guarded_slot_count - m_unused_count; i++)
+    {
+        if(slot(i)->live)
+            callback({ slot(i)->payload, slot(i)->usable_size(), HeapRegion::Guarded }, context);
+    }
+}
+
+void GuardedPool::report_fault(void* addr)
+{
+    // No locks and no stdio here, the fault may come from anywhere
+    if(!m_memory || !contains(addr))
+        return;
+    auto slot = reinterpret_cast<GuardedSlot*>((uptr)addr & ~(uptr)(heap_block_size - 1));
+    char const* what;
+    if((char*)addr < slot->data())
+        what = "Underflow";
+    else if((char*)addr >= slot->data_end())
+        what = "Overflow";
+    else if(slot->payload)
+        what = "Use after free";
+    else
+        what = "Access to an unused slot";
+
+    char message[256];
+    auto length = snprintf(message, sizeof(message), "heap: %s at %p, in the guarded allocation of %zu bytes at %p\n",
+        what, addr, slot->size, slot->payload);
+    write(STDERR_FILENO, message, length);
+    char const allocated[] = "Allocated from:\n";
+    write(STDERR_FILENO, allocated, sizeof(allocated) - 1);
+    backtrace_symbols_fd(slot->alloc_stack, slot->alloc_depth, STDERR_FILENO);
+    if(!slot->live)
+    {
+        char const freed[] = "Freed from:\n";
+        write(STDERR_FILENO, freed, sizeof(freed) - 1);
+        backtrace_symbols_fd(slot->free_stack, slot->free_depth, STDERR_FILENO);
+    }
+}
+
+// Size that can be used by the program (the requested size rounded up)
+size_t usable_size(void* addr)
+{
+    switch(block_kind_of(addr))
+    {
+        case BlockKind::Slab: return SlabBlock::containing(addr)->object_size();
+        case BlockKind::Big:  return BigBlockHeader::containing(addr)->usable_size();
+        case BlockKind::Guarded: return GuardedSlot::containing(addr)->usable_size();
+        default:              return (reinterpret_cast<HeapHeader*>(addr) - 1)->size;
+    }
+}
+
+// Heap profiler: sampled allocations, grouped by the stack they were
+// allocated from
+constexpr size_t profile_max_depth = 32;
+constexpr size_t profile_bucket_count = 2048; // Power of 2
+
+struct ProfileBucket
+{
+    u64 hash;
+    size_t depth;
+    void* stack[profile_max_depth];
+    size_t alloc_count;
+    size_t alloc_bytes;
+    size_t inuse_count;
+    size_t inuse_bytes;
+};
+
+class HeapProfile
+{
+public:
+    // Null if there is no space for a new stack
+    ProfileBucket* record_alloc(void* const* stack, size_t depth, size_t size);
+    void record_free(ProfileBucket* bucket, size_t size);
+
+    bool write(FILE* file);
+
+private:
+    Mutex m_lock;
+    size_t m_bucket_count {};
+    ProfileBucket m_buckets[profile_bucket_count] {};
+};
+
+HeapProfile g_heap_profile;
+
+ProfileBucket* HeapProfile::record_alloc(void* const* stack, size_t depth, size_t size)
+{
+    u64 hash = 0xCBF29CE484222325; // FNV-1a
+    for(size_t i = 0; i < depth; i++)
+        hash = (hash ^ (uptr)stack[i]) * 0x100000001B3;
+
+    Locker lock(m_lock);
+    // Buckets are never removed; linear probing, kept at most 3/4 full
+    for(size_t i = hash & (profile_bucket_count - 1);; i = (i + 1) & (profile_bucket_count - 1))
+    {
+        auto& bucket = m_buckets[i];
+        if(!bucket.alloc_count)
+        {
+            if(m_bucket_count >= profile_bucket_count / 4 * 3)
+                return nullptr;
+            m_bucket_count++;
+            bucket.hash = hash;
+            bucket.depth = depth;
+            memcpy(bucket.stack, stack, depth * sizeof(void*));
+        }
+        else if(bucket.hash != hash || bucket.depth != depth || memcmp(bucket.stack, stack, depth * sizeof(void*)))
+            continue;
+
+        bucket.alloc_count++;
+        bucket.alloc_bytes += size;
+        bucket.inuse_count++;
+        bucket.inuse_bytes += size;
+        return &bucket;
+    }
+}
+
+void HeapProfile::record_free(ProfileBucket* bucket, size_t size)
+{
+    Locker lock(m_lock);
+    bucket->inuse_count--;
+    bucket->inuse_bytes -= size;
+}
+
+// pprof legacy heap profile ("heap_v2"), with raw sample counts that pprof
+// scales by the sampling interval
+bool HeapProfile::write(FILE* file)
+{
+    {
+        Locker lock(m_lock);
+        ProfileBucket total {};
+        for(auto& bucket: m_buckets)
+        {
+            total.alloc_count += bucket.alloc_count;
+            total.alloc_bytes += bucket.alloc_bytes;
+            total.inuse_count += bucket.inuse_count;
+            total.inuse_bytes += bucket.inuse_bytes;
+        }
+        fprintf(file, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", total.inuse_count, total.inuse_bytes,
+            total.alloc_count, total.alloc_bytes, __atomic_load_n(&g_sample_interval, __ATOMIC_RELAXED));
+        for(auto& bucket: m_buckets)
+        {
+            if(!bucket.alloc_count)
+                continue;
+            fprintf(file, "%zu: %zu [%zu: %zu] @", bucket.inuse_count, bucket.inuse_bytes, bucket.alloc_count, bucket.alloc_bytes);
+            for(size_t i = 0; i < bucket.depth; i++)
+                fprintf(file, " %p", bucket.stack[i]);
+            fprintf(file, "\n");
+        }
+    }
+
+    // Needed to symbolize the addresses
+    fprintf(file, "\nMAPPED_LIBRARIES:\n");
+    auto maps = fopen("/proc/self/maps", "r");
+    if(!maps)
+        return false;
+    char buffer[4096];
+    size_t read;
+    while((read = fread(buffer, 1, sizeof(buffer), maps)))
+        fwrite(buffer, 1, read, file);
+    fclose(maps);
+    return !ferror(file);
+}
+
+// Sampled allocations are put in big blocks, so that their stack can be
+// found from the header when they are freed, and other frees don't need
+// any check
+[[gnu::noinline]] void* alloc_sampled(size_t size, size_t align, bool zero)
+{
+    // Skip this frame
+    void* stack[profile_max_depth + 1];
+    size_t depth = backtrace(stack, profile_max_depth + 1);
+
+    auto addr = alloc_big_block(size, align, zero);
+    if(!addr)
+        return nullptr;
+    auto header = BigBlockHeader::containing(addr);
+    if(depth > 1)
+        header->bucket = g_heap_profile.record_alloc(stack + 1, depth - 1, size);
+    if(header->bucket)
+    {
+        header->flags |= BigBlockHeader::Sampled;
+        header->sampled_size = size;
+    }
+    t_thread_cache.record_alloc(header->usable_size());
+    return addr;
+}
+
+// Allocation trace, buffered and written to the file in batches
+class Trace
+{
+public:
+    bool start(char const* path);
+    void stop();
+
+    bool enabled() const { return __atomic_load_n(&m_enabled, __ATOMIC_RELAXED); }
+    // Returns the index of the record
+    u64 record(HeapTraceRecord::Op op, uptr addr, uptr old_addr, size_t size, size_t align);
+
+private:
+    static constexpr size_t buffer_records = 1024;
+
+    static u64 now_ns();
+    bool flush();
+
+    Mutex m_lock;
+    bool m_enabled {};
+    int m_fd = -1;
+    u64 m_start_ns {};
+    size_t m_count {};
+    u64 m_index {};
+    HeapTraceRecord m_buffer[buffer_records];
+};
+
+Trace g_trace;
+
+u64 Trace::now_ns()
+{
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (u64)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+bool Trace::start(char const* path)
+{
+    Locker lock(m_lock);
+    if(m_fd >= 0)
+    {
+        printf("my_heap_trace_start: Already tracing\n");
+        return false;
+    }
+    m_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(m_fd < 0)
+    {
+        perror("my_heap_trace_start: open");
+        return false;
+    }
+
+    HeapTraceHeader header {};
+    memcpy(header.magic, heap_trace_magic, sizeof(header.magic));
+    header.version = heap_trace_version;
+    header.record_size = sizeof(HeapTraceRecord);
+    if(write(m_fd, &header, sizeof(header)) != sizeof(header))
+    {
+        perror("my_heap_trace_start: write");
+        close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+    m_start_ns = now_ns();
+    m_count = 0;
+    m_index = 0;
+    __atomic_store_n(&m_enabled, true, __ATOMIC_RELAXED);
+    return true;
+}
+
+void Trace::stop()
+{
+    Locker lock(m_lock);
+    if(m_fd < 0)
+        return;
+    __atomic_store_n(&m_enabled, false, __ATOMIC_RELAXED);
+    flush();
+    close(m_fd);
+    m_fd = -1;
+}
+
+u64 Trace::record(HeapTraceRecord::Op op, uptr addr, uptr old_addr, size_t size, size_t align)
+{
+    Locker lock(m_lock);
+    // Tracing may have been stopped meanwhile
+    if(m_fd < 0)
+        return 0;
+    auto& record = m_buffer[m_count++];
+    memset(&record, 0, sizeof(record));
+    record.time_ns = now_ns() - m_start_ns;
+    record.addr = addr;
+    record.old_addr = old_addr;
+    record.size = size;
+    record.align = align;
+    record.op = op;
+    if(m_count == buffer_records && !flush())
+    {
+        // Further records would describe a trace with holes
+        __atomic_store_n(&m_enabled, false, __ATOMIC_RELAXED);
+        close(m_fd);
+        m_fd = -1;
+    }
+    return m_index++;
+}
+
+bool Trace::flush()
+{
+    auto data = (char const*)m_buffer;
+    size_t size = m_count * sizeof(HeapTraceRecord);
+    m_count = 0;
+    while(size)
+    {
+        auto written = write(m_fd, data, size);
+        if(written < 0)
+        {
+            perror("my_heap_trace: write");
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+void* malloc_untraced(size_t size, size_t align)
+{
+    if(align == 0 || (align & (align - 1)))
+    {
+        printf("my_malloc: Invalid align %zu, must be a power of 2\n", align);
+        return nullptr;
+    }
+    align = max(align, min_align);
+
+    if(__builtin_expect(t_thread_cache.sample(size), false))
+        return alloc_sampled(size, align, false);
+
+    if(__builtin_expect(t_thread_cache.guard(), false))
+    {
+        // Not guarded if it doesn't fit in a slot or they are all in use
+        if(auto addr = g_guarded_pool.alloc(size, align))
+        {
+            t_thread_cache.record_alloc(usable_size(addr));
+            return addr;
+        }
+    }
+
+    if(size <= max_size_class && align <= min_align && t_thread_cache.usable())
+    {
+        auto cls = size_class_of(size);
+        t_thread_cache.record_alloc(size_classes[cls]);
+        return t_thread_cache.alloc(cls);
+    }
+
+    void* addr;
+    if(!HeapBlock::fits(size, align))
+        addr = alloc_big_block(size, align);
+    else
+        addr = Arena::current().alloc(size, align);
+    if(addr)
+        t_thread_cache.record_alloc(usable_size(addr));
+    return addr;
+}
+
+void* calloc_untraced(size_t count, size_t size)
+{
+    size_t total_size;
+    if(__builtin_mul_overflow(count, size, &total_size))
+    {
+        printf("my_calloc: %zu * %zu bytes overflows\n", count, size);
+        return nullptr;
+    }
+
+    // Thread caches hand out reused regions, just clear them
+    if(total_size <= max_size_class && t_thread_cache.usable())
+    {
+        auto addr = malloc_untraced(total_size, 1);
+        memset(addr, 0, total_size);
+        return addr;
+    }
+
+    if(__builtin_expect(t_thread_cache.sample(total_size), false))
+        return alloc_sampled(total_size, min_align, true);
+
+    void* addr;
+    if(total_size > HeapBlock::max_alloc_size())
+        addr = alloc_big_block(total_size, min_align, true);
+    else
+        addr = Arena::current().alloc(total_size, 1, true);
+    if(addr)
+        t_thread_cache.record_alloc(usable_size(addr));
+    return addr;
+}
+
+HeapStats my_heap_stats()
+{
+    static_assert(heap_size_class_count == size_class_count);
+
+    ThreadStats thread_stats {};
+    ThreadCache::total_stats(thread_stats);
+
+    HeapStats stats {};
+    stats.bytes_in_use = thread_stats.bytes_allocated - thread_stats.bytes_freed;
+    stats.bytes_mapped = __atomic_load_n(&g_counters.bytes_mapped, __ATOMIC_RELAXED);
+    stats.heap_blocks = __atomic_load_n(&g_counters.heap_blocks, __ATOMIC_RELAXED);
+    stats.slabs = __atomic_load_n(&g_counters.slabs, __ATOMIC_RELAXED);
+    stats.big_blocks = __atomic_load_n(&g_counters.big_blocks, __ATOMIC_RELAXED);
+    stats.big_block_bytes = __atomic_load_n(&g_counters.big_block_bytes, __ATOMIC_RELAXED);
+    stats.bump_blocks = __atomic_load_n(&g_counters.bump_blocks, __ATOMIC_RELAXED);
+    stats.mmap_count = __atomic_load_n(&g_counters.mmap_count, __ATOMIC_RELAXED);
+    stats.munmap_count = __atomic_load_n(&g_counters.munmap_count, __ATOMIC_RELAXED);
+    stats.mremap_count = __atomic_load_n(&g_counters.mremap_count, __ATOMIC_RELAXED);
+    stats.numa_nodes = max<size_t>(__atomic_load_n(&g_numa_node_count, __ATOMIC_RELAXED), 1);
+    stats.guarded = g_guarded_pool.live_count();
+    for(auto& arena: g_arenas)
+    {
+        stats.free_bytes += arena.free_regions().free_bytes();
+        stats.free_regions += arena.free_regions().region_count();
+    }
+    for(size_t i = 0; i < size_class_count; i++)
+        stats.class_sizes[i] = size_classes[i];
+    for(size_t i = 0; i <= size_class_count; i++)
+    {
+        stats.allocs[i] = thread_stats.allocs[i];
+        stats.frees[i] = thread_stats.frees[i];
+    }
+
+    // Counters are read one by one, so they may be slightly inconsistent
+    size_t block_bytes = (stats.heap_blocks + stats.slabs) * heap_block_size;
+    size_t small_bytes = stats.bytes_in_use - min(stats.big_block_bytes, stats.bytes_in_use);
+    if(block_bytes)
+        stats.fragmentation = 1.0 - (double)min(small_bytes, block_bytes) / block_bytes;
+    return stats;
+}
+
+void my_heap_set_placement(HeapPlacement placement)
+{
+    __atomic_store_n(&g_placement, placement, __ATOMIC_RELAXED);
+}
+
+void my_heap_set_sample_interval(size_t interval)
+{
+    __atomic_store_n(&g_sample_interval, interval, __ATOMIC_RELAXED);
+}
+
+void my_heap_set_guard_interval(size_t interval)
+{
+    __atomic_store_n(&g_guard_interval, interval, __ATOMIC_RELAXED);
+}
+
+bool my_heap_profile(char const* path)
+{
+    auto file = fopen(path, "w");
+    if(!file)
+    {
+        perror("my_heap_profile: fopen");
+        return false;
+    }
+    bool written = g_heap_profile.write(file);
+    if(fclose(file) != 0)
+        written = false;
+    if(!written)
+        printf("my_heap_profile: Failed to write %s\n", path);
+    return written;
+}
+
+bool my_heap_trace_start(char const* path)
+{
+    return g_trace.start(path);
+}
+
+void my_heap_trace_stop()
+{
+    g_trace.stop();
+}
+
+void my_heap_dump()
+{
+    printf("----- HEAP DUMP BEGIN -----\n");
+    for(auto& arena: g_arenas)
+        arena.dump();
+    printf("----- HEAP DUMP END -----\n");
+}
+
+bool my_heap_walk(HeapWalkCallback callback, void* context)
+{
+    // Regions cached by other threads are still reported as live
+    t_thread_cache.flush();
+    bool valid = true;
+    for(auto& arena: g_arenas)
+        valid &= arena.walk(callback, context);
+    g_big_blocks.walk(callback, context);
+    g_guarded_pool.walk(callback, context);
+    return valid;
+}
+
+void my_leak_check()
+{
+    struct Leaks
+    {
+        size_t count;
+        size_t bytes;
+    } leaks {};
+    bool valid = my_heap_walk([](HeapRegion const& region, void* context) {
+        auto leaks = static_cast<Leaks*>(context);
+        leaks->count++;
+        leaks->bytes += region.size;
+        printf("(Leak check) Leaked %zu bytes at %p\n", region.size, region.addr);
+    }, &leaks);
+
+    if(!valid)
+        printf("(Leak check) Heap corrupted\n");
+    if(leaks.count)
+        printf("(Leak check) %zu leaks, %zu bytes in total\n", leaks.count, leaks.bytes);
+    else
+        printf("(Leak check) No leak found. Congratulations!\n");
+}
+
+// Frees the allocation, except when it has to be freed by the arena of the
+// calling thread, under its lock; false then, so that the caller can free
+// many of them at once
+bool free_or_defer(void* addr)
+{
+    if(!addr)
+        return true;
+
+    auto kind = block_kind_of(addr);
+    if(HeapPolicy::check_headers && kind == BlockKind::Bump)
     {
-        return signature == Signature::BigBlock
-            || signature == Signature::Empty
-            || signature == Signature::Used
-            || signature == Signature::EndEdge
-            || signature == Signature::Freed;
+        printf("my_free: %p belongs to a bump arena\n", addr);
+        abort();
     }
-
-    bool available() const
+    if(kind == BlockKind::Slab)
     {
-        return signature == Signature::Empty
-            || signature == Signature::Freed;
+        auto slab = SlabBlock::containing(addr);
+        t_thread_cache.record_free(slab->object_size());
+        if(t_thread_cache.usable())
+        {
+            t_thread_cache.free(addr, slab->size_class());
+            return true;
+        }
+        if(slab->arena() != &Arena::current())
+        {
+            slab->arena()->free_remote(addr);
+            return true;
+        }
+        return false;
     }
 
-    bool freed() const
+    if(kind == BlockKind::Guarded)
     {
-        return signature == Signature::Freed;
+        t_thread_cache.record_free(usable_size(addr));
+        g_guarded_pool.free(addr);
+        return true;
     }
 
-    char const* signature_string() const
+    if(kind == BlockKind::Big)
     {
-        switch(signature)
+        auto big_header = BigBlockHeader::containing(addr);
+        if(HeapPolicy::check_headers && addr != big_header->payload())
         {
-            case Signature::Used:       return "USED";
-            case Signature::Empty:      return "EMPTY";
-            case Signature::EndEdge:    return "END_EDGE";
-            case Signature::Freed:      return "FREED";
-            case Signature::BigBlock:   return "BIG_BLOCK";
-            case Signature::ScrubBytes: return "SCRUB_BYTES";
-            default:                    return nullptr;
+            printf("my_free: %p is not the payload of big block %p\n", addr, big_header);
+            abort();
+        }
+        if constexpr(HeapPolicy::diagnostics)
+            printf("my_free: Freeing big block\n");
+        if(big_header->flags & BigBlockHeader::Sampled)
+        {
+            g_heap_profile.record_free(big_header->bucket, big_header->sampled_size);
+            big_header->flags &= ~BigBlockHeader::Sampled;
         }
+        t_thread_cache.record_free(big_header->usable_size());
+        g_big_blocks.remove(big_header);
+        uncount(g_counters.big_blocks);
+        uncount(g_counters.big_block_bytes, big_header->usable_size());
+        auto size = big_header->size;
+        if(!g_big_block_cache.put(big_header, size, big_header->flags))
+            os_unmap(big_header, size);
+        return true;
     }
 
-    void print_signature() const
+    HeapHeader* header = reinterpret_cast<HeapHeader*>(addr) - 1;
+
+    if(header->freed())
     {
-        if(signature_string())
-            printf("%s", signature_string());
-        else
-            printf("?0x%x?", signature);
+        printf("my_free: Block already freed\n");
+        abort();
     }
-};
+    header->check_canary("my_free");
 
-class HeapBlock
-{
-public:
-    HeapBlock(HeapBlock* prev)
-    : m_prev(prev)
+    //my_heap_dump();
+    t_thread_cache.record_free(header->size);
+    auto cls = exact_size_class_of(header->size);
+    if(header->signature == Signature::Used && cls != size_class_count && t_thread_cache.usable())
     {
-        init();
+        t_thread_cache.free(addr, cls);
+        return true;
     }
 
-    void* alloc(size_t size, size_t align);
-    void free(void* addr);
-    void leak_check();
-    void dump();
-
-private:
-    void init();
-    void place_edge_headers();
-    void ensure_next_allocated_from_os();
-    void merge_and_cleanup();
-
-    HeapBlock* m_prev {};
-    HeapBlock* m_next {};
-    char m_data[heap_block_size - sizeof(void*) * 2];
-};
-
-static_assert(sizeof(HeapBlock) == heap_block_size);
-
-void HeapBlock::place_edge_headers()
-{
-    new (m_data) HeapHeader {Signature::Empty, sizeof(m_data) - sizeof(HeapHeader) * 2};
-    new (end(m_data) - sizeof(HeapHeader)) HeapHeader {Signature::EndEdge};
+    auto owner = HeapBlock::containing(addr)->arena();
+    if(owner != &Arena::current())
+    {
+        owner->free_remote(addr);
+        return true;
+    }
+    return false;
 }
 
-void HeapBlock::init()
+void free_untraced(void* addr)
 {
-    place_edge_headers();
-
-    // Initialize rest of heap with scrub bytes
-    memset(m_data + sizeof(HeapHeader), 0xef, sizeof(m_data) - sizeof(HeapHeader) * 2);
+    if(!free_or_defer(addr))
+        Arena::current().free(addr);
 }
 
-void HeapBlock::ensure_next_allocated_from_os()
+void* realloc_untraced(void* addr, size_t size)
 {
-    if(!m_next)
+    if(!addr)
+        return malloc_untraced(size, 1);
+    if(!size)
     {
-        // Request a new memory block from the OS
-        auto memory = (char*)mmap(nullptr, sizeof(HeapBlock), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-        if(!memory)
-        {
-            perror("HeapBlock::alloc: mmap");
-            abort();
-        }
-
-        m_next = reinterpret_cast<HeapBlock*>(memory);
-        new(m_next) HeapBlock{this};
+        free_untraced(addr);
+        return nullptr;
     }
-}
 
-void HeapBlock::merge_and_cleanup()
-{
-    // Merge adjacent blocks
-    auto header = reinterpret_cast<HeapHeader*>(m_data);
-    while(header)
+    auto kind = block_kind_of(addr);
+    size_t old_size;
+    if(kind == BlockKind::Slab)
     {
-        if(header->available())
+        // Objects can't be resized, but shrinking one may just keep it, as
+        // long as the size class still follows from the size (my_free_sized())
+        auto slab = SlabBlock::containing(addr);
+        old_size = slab->object_size();
+        if(size <= old_size && size_class_of(size) == slab->size_class())
+            return addr;
+    }
+    else if(kind == BlockKind::Big)
+    {
+        // mremap() can't be used for reserved huge pages, these are copied
+        auto header = BigBlockHeader::containing(addr);
+        if(size > HeapBlock::max_alloc_size() && size <= max_big_block_size && !(header->flags & BigBlockHeader::HugeTlb))
         {
-            auto base_header = header;
-            size_t size = header->size;
-            while(header)
+            // Let the kernel resize the mapping in place, or move the pages
+            // instead of copying them. The new place must be aligned to
+            // heap_block_size, like every block (bigger alignments are not kept).
+            size_t total_size = (header->payload_offset + size + page_size() - 1) & ~(page_size() - 1);
+            auto memory = os_remap(header, header->size, total_size, 0);
+            if(!memory)
             {
-                auto next_header = header->next();
-                if(next_header && next_header->available())
-                    size += next_header->size + sizeof(HeapHeader);
-                else
+                auto target = map_aligned(total_size, heap_block_size);
+                if(!target)
+                {
+                    perror("my_realloc: mmap");
+                    return nullptr;
+                }
+                // The header moves with the mapping, it can't stay linked
+                g_big_blocks.remove(header);
+                memory = os_remap(header, header->size, total_size, MREMAP_MAYMOVE | MREMAP_FIXED, target);
+                if(!memory)
                 {
-                    header = next_header;
-                    break;
+                    perror("my_realloc: mremap");
+                    g_big_blocks.add(header);
+                    os_unmap(target, total_size);
+                    return nullptr;
                 }
-                header = next_header;
+                g_big_blocks.add(static_cast<BigBlockHeader*>(memory));
             }
-            base_header->size = size;
+            if(total_size >= huge_page_threshold)
+                madvise(memory, total_size, MADV_HUGEPAGE);
+            header = static_cast<BigBlockHeader*>(memory);
+            auto old_usable_size = header->usable_size();
+            header->size = total_size;
+            t_thread_cache.record_resize(old_usable_size, header->usable_size());
+            count(g_counters.big_block_bytes, header->usable_size());
+            uncount(g_counters.big_block_bytes, old_usable_size);
+            return header->payload();
         }
-        else
-            header = header->next();
+        old_size = header->size - header->payload_offset;
     }
-
-    // Remove the whole block if it is made up from just freed blocks
-    header = reinterpret_cast<HeapHeader*>(m_data);
-    if(header->available() && header->size == sizeof(m_data) - sizeof(HeapHeader) * 2)
+    else if(kind == BlockKind::Guarded)
+        old_size = usable_size(addr);
+    else
     {
-        if(m_prev)
+        auto header = reinterpret_cast<HeapHeader*>(addr) - 1;
+        if(header->freed())
         {
-            if(m_next)
-                m_next->m_prev = m_prev;
-            m_prev->m_next = m_next;
-            // !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-            // WARNING: This is very unsafe when done improperly.
-            // Don't do ANYTHING after this instruction 
-            // !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-            if(munmap(this, sizeof(HeapBlock)) < 0)
-            {
-                perror("HeapBlock::free: munmap");
-                abort();
-            }
+            printf("my_realloc: Block already freed\n");
+            abort();
+        }
+        header->check_canary("my_realloc");
+        old_size = header->size;
+        if(size <= HeapBlock::max_alloc_size() && HeapBlock::containing(addr)->arena()->resize(addr, size))
+        {
+            t_thread_cache.record_resize(old_size, header->size);
+            return addr;
         }
     }
-}
 
-void* HeapBlock::alloc(size_t size, size_t align)
-{
-    if(align == 0)
-    {
-        printf("heap_alloc_impl: Invalid align!\n");
+    auto new_addr = malloc_untraced(size, 1);
+    if(!new_addr)
         return nullptr;
-    }
-
-    // Require at least 8-byte alignment
-    align = max(sizeof(size_t), align);
-
-    // Align size
-    size_t old_size = size;
-    //printf("Size before align %zx: %zu\n", align - 1, size);
-    size &= ~(align - 1);
-    size += align;
-    // sanity check
-    assert(old_size <= size);
-    //printf("Size after align: %zu\n", size);
+    memcpy(new_addr, addr, min(old_size, size));
+    free_untraced(addr);
+    return new_addr;
+}
 
-    HeapHeader* header = reinterpret_cast<HeapHeader*>(&m_data);
+// Small regions are always of the size class of their requested size (or
+// the last size given to my_realloc()), except the heap regions that also
+// took the rest of a free region; so the size class is known from the size,
+// and it goes straight to the thread cache.
+void free_sized_untraced(void* addr, size_t size)
+{
+    if(!addr)
+        return;
+    if(size > max_size_class || !t_thread_cache.usable())
+        return free_untraced(addr);
 
-    while(header)
+    // Sampled allocations are big blocks of any size
+    auto kind = block_kind_of(addr);
+    auto cls = size_class_of(size);
+    if(kind == BlockKind::Slab && is_slab_class(cls))
     {
-        //printf("HEADER %x size=%u @%p next @%p\n", (uint32_t)header->signature, header->size, header, header->next());
-        if(!header->valid_signature())
+        if(HeapPolicy::check_headers && SlabBlock::containing(addr)->size_class() != cls)
         {
-            printf("heap_alloc_impl: Invalid header signature %x at %p\n", (u32)header->signature, header);
+            printf("my_free_sized: Size %zu doesn't match the object of %zu bytes\n", size, SlabBlock::containing(addr)->object_size());
             abort();
         }
-        if(header->available())
+        t_thread_cache.record_free(size_classes[cls]);
+        t_thread_cache.free(addr, cls);
+        return;
+    }
+
+    if(kind == BlockKind::Heap)
+    {
+        auto header = reinterpret_cast<HeapHeader*>(addr) - 1;
+        if(HeapPolicy::check_headers && header->signature == Signature::Used && header->size < size)
         {
-            // Calculate total free size
-            size_t free_size = header->size;
-            //printf("free_size=%zu, header_size=%zu, required_size=%zu\n", free_size, sizeof(HeapHeader), size);
-            if(free_size < size + sizeof(HeapHeader) * 2)
-            {
-                // skip and try next block
-                //printf("Skipping\n");
-            }
-            else
-            {
-                //printf("Allocating %zu bytes\n", size);
-
-                auto distance_to_next_header = header->size - size - sizeof(HeapHeader);
-
-                // set old header to be used
-                header->signature = Signature::Used;
-                header->size = size;
-                
-                // create a new header after data
-                auto new_header_address = header->next();
-                new (new_header_address) HeapHeader {Signature::Empty, static_cast<u32>(distance_to_next_header)};
-                return (void*)(header + 1);
-            }
+            printf("my_free_sized: Size %zu doesn't match the region of %u bytes\n", size, header->size);
+            abort();
         }
-
-        // Check for overflow
-        if(header->signature == Signature::EndEdge)
+        if(header->signature == Signature::Used && header->size == size_classes[cls])
         {
-            ensure_next_allocated_from_os();
-            return m_next->alloc(size, align);
+            header->check_canary("my_free_sized");
+            t_thread_cache.record_free(size_classes[cls]);
+            t_thread_cache.free(addr, cls);
+            return;
         }
-
-        // Try out next header, if it exists.
-        header = header->next();
     }
-    printf("HeapBlock::alloc: No suitable block found!\n");
-    return nullptr;
+    free_untraced(addr);
 }
 
-void HeapBlock::free(void* addr)
+size_t malloc_batch_untraced(size_t size, size_t count, void** addrs)
 {
-    if(addr < m_data || addr >= end(m_data))
+    size_t done = 0;
+    if(count && __builtin_expect(t_thread_cache.sample(size * count), false))
     {
-        if(m_next)
-            m_next->free(addr);
-        else
-        {
-            printf("HeapBlock::free: %p was not allocated on heap\n", addr);
-            abort();
-        }
-        return;
+        if(!(addrs[0] = alloc_sampled(size, min_align, false)))
+            return 0;
+        done++;
     }
 
-    HeapHeader* header = reinterpret_cast<HeapHeader*>(addr) - 1;
-    if(header->freed())
+    if(size <= max_size_class && t_thread_cache.usable())
     {
-        printf("HeapBlock::free: Block already freed\n");
-        abort();
+        auto cls = size_class_of(size);
+        auto taken = t_thread_cache.take(cls, count - done, addrs + done);
+        for(size_t i = 0; i < taken; i++)
+            t_thread_cache.record_alloc(size_classes[cls]);
+        done += taken;
     }
-    if(!header->valid_signature())
+
+    if(HeapBlock::fits(size, min_align))
     {
-        printf("HeapBlock::free: Invalid header signature %x (addr=%p)\n", (u32)header->signature, header);
-        abort();
+        if(done < count)
+            Arena::current().alloc_batch(size, count - done, addrs + done);
+        for(; done < count; done++)
+            t_thread_cache.record_alloc(usable_size(addrs[done]));
+        return done;
     }
 
-    header->signature = Signature::Freed;
-    merge_and_cleanup();
+    for(; done < count; done++)
+    {
+        addrs[done] = alloc_big_block(size);
+        if(!addrs[done])
+            break;
+        t_thread_cache.record_alloc(usable_size(addrs[done]));
+    }
+    return done;
 }
 
-void HeapBlock::leak_check()
+void free_batch_untraced(void* const* addrs, size_t count)
 {
-    printf("HeapBlock: Starting leak check on heap %p\n", this);
-
-    // TODO: Check also big blocks??
-    HeapHeader* header = reinterpret_cast<HeapHeader*>(m_data);
-    bool leak_found = false;
-    while(header)
+    // What stays for the arena of this thread is freed under one lock
+    void* deferred[64];
+    size_t deferred_count = 0;
+    for(size_t i = 0; i < count; i++)
     {
-        if(header->signature == Signature::Used)
-        {
-            if(header->size > 0)
-            {
-                printf("(Leak check) Leaked %u bytes at %p\n", header->size, header + 1);
-                leak_found = true;
-            }
-            header = header->next();
+        if(free_or_defer(addrs[i]))
             continue;
-        }
-        if(!header->valid_signature())
+        deferred[deferred_count++] = addrs[i];
+        if(deferred_count == sizeof(deferred) / sizeof(deferred[0]))
         {
-            printf("(Leak check) Heap corrupted at %p\n", header);
-            leak_found = true;
-            break;
+            Arena::current().free_batch(deferred, deferred_count);
+            deferred_count = 0;
         }
-        header = header->next();
     }
-
-    if(m_next)
-        m_next->leak_check();
-    if(!leak_found)
-        printf("(Leak check) No leak found on heap %p. Congratulations!\n", this);
+    if(deferred_count)
+        Arena::current().free_batch(deferred, deferred_count);
 }
 
-void HeapBlock::dump()
+void* my_malloc(size_t size, size_t align)
 {
-    HeapHeader* header = reinterpret_cast<HeapHeader*>(m_data);
-
-    printf(" :: Heap %p; next = %p\n", this, m_next);
-    while(header)
-    {
-        if(!header->valid_signature())
-        {
-            printf("(corrupted at %p, signature is %x)\n", header, (u32)header->signature);
-            abort();
-        }
-
-        printf("    * %zu +%u",
-            (reinterpret_cast<size_t>(header) - reinterpret_cast<size_t>(m_data)),
-            header->size);
-        if(header->next())
-            printf(" next: %lu (%p)", reinterpret_cast<size_t>(header->next()) - reinterpret_cast<size_t>(m_data), header->next());
+    auto addr = malloc_untraced(size, align);
+    if(g_trace.enabled())
+        g_trace.record(HeapTraceRecord::Malloc, (uptr)addr, 0, size, align);
+    return addr;
+}
 
-        if(header->available())
-            printf(" (available)");
-        if(header->freed())
-            printf(" (freed)");
-        printf(" ");
-        header->print_signature();
+void* my_calloc(size_t count, size_t size)
+{
+    auto addr = calloc_untraced(count, size);
+    if(g_trace.enabled())
+        g_trace.record(HeapTraceRecord::Calloc, (uptr)addr, 0, count * size, 1);
+    return addr;
+}
 
-        printf(" :: addr: %p\n", (header + 1));
-        header = header->next();
-    }
-    if(m_next)
-        m_next->dump();
+void my_free(void* addr)
+{
+    // Before the free, the address may be reused by another thread right after it
+    if(addr && g_trace.enabled())
+        g_trace.record(HeapTraceRecord::Free, (uptr)addr, 0, 0, 0);
+    free_untraced(addr);
 }
 
-// This is a hack to enable lazy-construction of heap also allowing to
-// call member functions of HeapBlock
-alignas(sizeof(HeapBlock)) char g_heap_data[sizeof(HeapBlock)];
-HeapBlock& g_heap_storage = *reinterpret_cast<HeapBlock*>(&g_heap_data);
-bool g_heap_initialized { false };
+void my_free_sized(void* addr, size_t size)
+{
+    if(addr && g_trace.enabled())
+        g_trace.record(HeapTraceRecord::Free, (uptr)addr, 0, 0, 0);
+    free_sized_untraced(addr, size);
+}
 
-void* my_malloc(size_t size, size_t align)
+size_t my_malloc_batch(size_t size, size_t count, void** addrs)
 {
-    if(!g_heap_initialized)
+    auto done = malloc_batch_untraced(size, count, addrs);
+    if(g_trace.enabled())
     {
-        new (&g_heap_storage) HeapBlock{nullptr};
-        g_heap_initialized = true;
+        for(size_t i = 0; i < done; i++)
+            g_trace.record(HeapTraceRecord::Malloc, (uptr)addrs[i], 0, size, 1);
     }
-    assert(g_heap_initialized);
+    return done;
+}
 
-    if(size > sizeof(HeapBlock) - sizeof(HeapHeader))
+void my_free_batch(void* const* addrs, size_t count)
+{
+    if(g_trace.enabled())
     {
-        //printf("my_malloc: Too big size: %zu, allocating big block!\n", size);
-        auto memory = (char*)mmap(nullptr, size + sizeof(HeapHeader), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-        if(!memory)
+        for(size_t i = 0; i < count; i++)
         {
-            perror("my_malloc: mmap");
-            return nullptr;
+            if(addrs[i])
+                g_trace.record(HeapTraceRecord::Free, (uptr)addrs[i], 0, 0, 0);
         }
-        auto header = reinterpret_cast<HeapHeader*>(memory);
-        header->signature = Signature::BigBlock;
-        header->size = size + sizeof(HeapHeader);
-        return header + 1;
     }
-    return g_heap_storage.alloc(size, align);
+    free_batch_untraced(addrs, count);
 }
 
-void my_heap_dump()
+void* my_realloc(void* addr, size_t size)
 {
-    printf("----- HEAP DUMP BEGIN -----\n");
-    if(!g_heap_initialized)
-    {
-        printf("(heap is not initialized)\n");
-        return;
-    }
-    g_heap_storage.dump();
-    printf("----- HEAP DUMP END -----\n");
+    if(!g_trace.enabled())
+        return realloc_untraced(addr, size);
+
+    // Recorded before, like a free; the result is recorded separately if
+    // there is one (meanwhile, other threads may reuse the old address)
+    auto index = g_trace.record(HeapTraceRecord::Realloc, 0, (uptr)addr, size, 1);
+    auto new_addr = realloc_untraced(addr, size);
+    if(new_addr)
+        g_trace.record(HeapTraceRecord::ReallocResult, (uptr)new_addr, index, size, 1);
+    return new_addr;
 }
 
-void my_leak_check()
+// Start of every chunk of a bump arena; objects follow it
+struct BumpArena::Chunk
 {
-    g_heap_storage.leak_check();
-}
+    BlockKind kind { BlockKind::Bump };
+    Arena* arena;
+    Chunk* next;
+};
 
-void my_free(void* addr)
+// Bigger objects get regions of their own, so that the chunks are not
+// mostly wasted; these are listed in nodes allocated in the arena itself
+struct BumpArena::Oversized
 {
-    HeapHeader* header = reinterpret_cast<HeapHeader*>(addr) - 1;
-    if(header->signature == Signature::BigBlock)
+    void* addr;
+    Oversized* next;
+};
+
+constexpr size_t bump_chunk_data_offset = (sizeof(BumpArena::Chunk) + min_align - 1) & ~(min_align - 1);
+constexpr size_t bump_max_object_size = (heap_block_size - bump_chunk_data_offset) / 4;
+
+void* BumpArena::alloc(size_t size, size_t align)
+{
+    if(align == 0 || (align & (align - 1)))
     {
-        printf("my_free: Freeing big block\n");
-        munmap(header, header->size);
-        return;
+        printf("BumpArena::alloc: Invalid align %zu, must be a power of 2\n", align);
+        return nullptr;
     }
 
-    if(!g_heap_initialized)
+    auto aligned = ((uptr)m_current + align - 1) & ~(uptr)(align - 1);
+    if(m_current && aligned <= (uptr)m_end && size <= (uptr)m_end - aligned)
     {
-        printf("my_free: Heap is not initialized\n");
-        abort();
+        m_current = (char*)aligned + size;
+        return (void*)aligned;
     }
+    if(size + align > bump_max_object_size)
+        return alloc_oversized(size, align);
 
-    //my_heap_dump();
-    g_heap_storage.free(addr);
+    auto& arena = Arena::current();
+    auto chunk = new (arena.take_block()) Chunk;
+    chunk->arena = &arena;
+    chunk->next = m_chunks;
+    m_chunks = chunk;
+    count(g_counters.bump_blocks);
+    if constexpr(HeapPolicy::scrub)
+        memset((char*)chunk + bump_chunk_data_offset, 0xef, heap_block_size - bump_chunk_data_offset);
+
+    m_current = (char*)chunk + bump_chunk_data_offset;
+    m_end = (char*)chunk + heap_block_size;
+    return alloc(size, align);
+}
+
+void* BumpArena::alloc_oversized(size_t size, size_t align)
+{
+    auto node = static_cast<Oversized*>(alloc(sizeof(Oversized), alignof(Oversized)));
+    if(!node)
+        return nullptr;
+    node->addr = malloc_untraced(size, align);
+    if(!node->addr)
+        return nullptr;
+    node->next = m_oversized;
+    m_oversized = node;
+    return node->addr;
+}
+
+void BumpArena::release()
+{
+    // Nodes are in the chunks, so these go first
+    for(auto node = m_oversized; node; node = node->next)
+        free_untraced(node->addr);
+    for(auto chunk = m_chunks; chunk;)
+    {
+        auto next = chunk->next;
+        chunk->arena->put_block(chunk);
+        uncount(g_counters.bump_blocks);
+        chunk = next;
+    }
+    m_chunks = nullptr;
+    m_oversized = nullptr;
+    m_current = nullptr;
+    m_end = nullptr;
 }
 
 // Setup custom operators to see if this works for real code :)
@@ -434,47 +3794,61 @@ void* operator new[](size_t, void* addr) noexcept
 {
     return addr;
 }
+
+// Without HEAP_NO_GLOBAL_OPERATORS; otherwise only the containers using
+// heap_pmr.hpp use the heap
+#ifndef HEAP_NO_GLOBAL_OPERATORS
 void* operator new(size_t size)
 {
     auto addr = my_malloc(size);
-    //my_heap_dump();
     return addr;
 }
-void* operator new(size_t size, size_t align)
+void* operator new(size_t size, std::align_val_t align)
 {
-    auto addr = my_malloc(size, align);
-    //my_heap_dump();
+    auto addr = my_malloc(size, static_cast<size_t>(align));
     return addr;
 }
 void* operator new[](size_t size)
 {
     auto addr = my_malloc(size);
-    //my_heap_dump();
     return addr;
 }
-void* operator new[](size_t size, size_t align)
+void* operator new[](size_t size, std::align_val_t align)
 {
-    auto addr = my_malloc(size, align);
-    //my_heap_dump();
+    auto addr = my_malloc(size, static_cast<size_t>(align));
     return addr;
 }
 void operator delete(void* v) noexcept
 {
     my_free(v);
-    //my_heap_dump();
 }
-void operator delete(void* v, size_t) noexcept
+void operator delete(void* v, size_t size) noexcept
 {
-    my_free(v);
-    //my_heap_dump();
+    my_free_sized(v, size);
 }
 void operator delete[](void* v) noexcept
 {
     my_free(v);
-    //my_heap_dump();
 }
-void operator delete[](void* v, size_t) noexcept
+void operator delete[](void* v, size_t size) noexcept
+{
+    my_free_sized(v, size);
+}
+void operator delete(void* v, std::align_val_t) noexcept
+{
+    my_free(v);
+}
+void operator delete(void* v, size_t, std::align_val_t) noexcept
+{
+    my_free(v);
+}
+void operator delete[](void* v, std::align_val_t) noexcept
 {
     my_free(v);
-    //my_heap_dump();
 }
+void operator delete[](void* v, size_t, std::align_val_t) noexcept
+{
+    my_free(v);
+}
+
+#endif
@@ -1,28 +1,213 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 
-constexpr size_t heap_block_size = 1 << 14; // 16 KiB / 4 page
+// Size of heap blocks and slabs, can be set at compile time (e.g. 64 KiB -
+// 2 MiB for big heaps). Must be a power of 2, at least 16 KiB.
+#ifndef HEAP_BLOCK_SIZE
+#define HEAP_BLOCK_SIZE (1 << 14) // 16 KiB / 4 page
+#endif
 
+constexpr size_t heap_block_size = HEAP_BLOCK_SIZE;
+static_assert((heap_block_size & (heap_block_size - 1)) == 0, "Heap block size must be a power of 2");
+static_assert(heap_block_size >= 1 << 14 && heap_block_size <= 1 << 30, "Heap block size must be between 16 KiB and 1 GiB");
+
+// <new> can't be included here, it defines placement new
+namespace std { enum class align_val_t : size_t; }
+
+// `align` must be a power of 2; memory is always at least 16-byte aligned
 void* my_malloc(size_t size, size_t align = 1);
 void my_free(void* addr);
+// Faster my_free() for a known size, which must be the size the memory
+// was allocated with (or last given to my_realloc())
+void my_free_sized(void* addr, size_t size);
+// Allocate `count` regions of `size` bytes into `addrs`: what the thread
+// cache doesn't have is allocated under a single lock of the arena, in one
+// walk of its heap blocks. Returns how many were allocated (less than
+// `count` only if the memory ran out).
+size_t my_malloc_batch(size_t size, size_t count, void** addrs);
+// Free `count` regions (null ones are skipped); the ones that don't go to
+// the thread cache are freed under a single lock of the arena
+void my_free_batch(void* const* addrs, size_t count);
+void* my_realloc(void* addr, size_t size);
+void* my_calloc(size_t count, size_t size);
 void my_heap_dump();
+// Prints all live allocations (leaks, at the end of the program) and their
+// total; it doesn't abort on a corrupted heap
 void my_leak_check();
 
+// Live allocation, as seen by my_heap_walk()
+struct HeapRegion
+{
+    enum Kind { Heap, Slab, Big, Guarded };
+
+    void* addr;
+    size_t size; // Usable size
+    Kind kind;
+};
+
+// Calls `callback` for every live allocation: used regions of heap blocks,
+// slab objects, big blocks and guarded allocations. Nothing is printed; returns false if a
+// corrupted header was found in a heap block (it is skipped). The callback
+// runs with heap locks held, so it must not allocate or free. Regions
+// cached by other threads than the calling one are reported as live.
+using HeapWalkCallback = void (*)(HeapRegion const& region, void* context);
+bool my_heap_walk(HeapWalkCallback callback, void* context);
+
+constexpr size_t heap_size_class_count = 20;
+
+struct HeapStats
+{
+    size_t bytes_in_use;    // Usable size of all allocations (requested sizes rounded up)
+    size_t bytes_mapped;    // Memory mapped from the OS, also the retained and cached parts
+    size_t heap_blocks;
+    size_t slabs;
+    size_t big_blocks;
+    size_t big_block_bytes; // Part of bytes_in_use that is in big blocks
+    size_t bump_blocks;     // Blocks used by bump arenas (not in bytes_in_use)
+    size_t mmap_count;
+    size_t munmap_count;
+    size_t mremap_count;
+    size_t numa_nodes;      // Arenas and their memory are spread over these
+    size_t guarded;         // Live allocations in guarded slots
+    // Available regions of heap blocks (not the cached ones): many small
+    // ones mean that the free space is fragmented
+    size_t free_bytes;
+    size_t free_regions;
+    // Allocations and frees per size class; the last entry counts the
+    // allocations bigger than any class
+    size_t class_sizes[heap_size_class_count];
+    size_t allocs[heap_size_class_count + 1];
+    size_t frees[heap_size_class_count + 1];
+    // Part of heap blocks and slabs that is not in use (0 - 1)
+    double fragmentation;
+};
+
+// Counters are maintained on the fly, so this is cheap (it doesn't walk
+// the heap); it can be called at any time from any thread
+HeapStats my_heap_stats();
+
+// Where allocations that don't come from slabs, caches or big blocks are
+// placed in heap blocks:
+// - FirstFit (the default): the first region that fits, from the first block
+// - NextFit: the first one after the previous allocation, wrapping around
+// - BestFit: the smallest one, from free regions kept in bins by size
+// It can be changed at any time, also with live allocations.
+enum class HeapPlacement
+{
+    FirstFit,
+    NextFit,
+    BestFit,
+};
+
+void my_heap_set_placement(HeapPlacement placement);
+
+// Heap profiler: samples one allocation per `interval` allocated bytes on
+// average (0, the default, disables it). Sampled allocations are recorded
+// with their stack, and written by my_heap_profile() in the pprof legacy
+// heap format (`pprof <binary> <path>`); returns false on error.
+void my_heap_set_sample_interval(size_t interval);
+bool my_heap_profile(char const* path);
+
+// Hardening: places one allocation per `interval` allocations on average
+// (0, the default, disables it) between inaccessible guard pages, where
+// overflows, underflows and uses after free fault right away. The fault is
+// reported on stderr with the stacks of the allocation and the free, then
+// the program crashes as usual. Only allocations of up to a block minus 3
+// pages (and aligned to at most a page) can be guarded, at most 64 at a
+// time. Independently, headers of heap regions always have a canary,
+// checked when they are freed or resized.
+void my_heap_set_guard_interval(size_t interval);
+
+// Allocation trace: while enabled, every my_malloc(), my_calloc(),
+// my_realloc() and my_free() (also through new/delete) is appended to the
+// file, which can be replayed by heap_replay. The file is a HeapTraceHeader
+// followed by HeapTraceRecords, in the byte order of the machine.
+constexpr char heap_trace_magic[8] = { 'H', 'E', 'A', 'P', 'T', 'R', 'C', '\0' };
+constexpr uint32_t heap_trace_version = 1;
+
+struct HeapTraceHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+struct HeapTraceRecord
+{
+    enum Op : uint8_t
+    {
+        Malloc,        // addr = my_malloc(size, align)
+        Calloc,        // addr = my_calloc(1, size)
+        Free,          // my_free(addr)
+        Realloc,       // my_realloc(old_addr, size), before it is done
+        ReallocResult, // Its result addr, unless it failed; old_addr is the index of the Realloc record
+    };
+
+    uint64_t time_ns;  // Since the start of the trace
+    uint64_t addr;     // Addresses identify allocations, while they are live
+    uint64_t old_addr;
+    uint64_t size;
+    uint32_t align;
+    Op op;
+};
+
+// Starting returns false on error; a write error stops the trace
+bool my_heap_trace_start(char const* path);
+void my_heap_trace_stop();
+
+// Bump-pointer allocator for short-lived memory (e.g. per request): it takes
+// whole blocks from the heap and hands out objects without headers. There
+// is no free, all of the memory is given back at once by release() or the
+// destructor. Objects bigger than a quarter of a block are allocated from
+// the heap separately. Not thread-safe.
+class BumpArena
+{
+public:
+    BumpArena() = default;
+    ~BumpArena() { release(); }
+
+    BumpArena(BumpArena const&) = delete;
+    BumpArena& operator=(BumpArena const&) = delete;
+
+    // `align` must be a power of 2; returns null when out of memory
+    void* alloc(size_t size, size_t align = 16);
+    void release();
+
+    struct Chunk;
+    struct Oversized;
+
+private:
+    void* alloc_oversized(size_t size, size_t align);
+
+    Chunk* m_chunks {};
+    Oversized* m_oversized {};
+    char* m_current {};
+    char* m_end {};
+};
+
 // Setup custom operators to see if this works for real code :)
+// (HEAP_NO_GLOBAL_OPERATORS leaves new/delete to the standard library)
 
 // Placement new
 void* operator new(size_t, void*) noexcept;
 void* operator new[](size_t, void*) noexcept;
 
+#ifndef HEAP_NO_GLOBAL_OPERATORS
 // New
 void* operator new(size_t size);
-void* operator new(size_t size, size_t align);
+void* operator new(size_t size, std::align_val_t align);
 void* operator new[](size_t size);
-void* operator new[](size_t size, size_t align);
+void* operator new[](size_t size, std::align_val_t align);
 
 // Delete
 void operator delete(void* v) noexcept;
 void operator delete(void* v, size_t) noexcept;
 void operator delete[](void* v) noexcept;
 void operator delete[](void* v, size_t) noexcept;
+void operator delete(void* v, std::align_val_t) noexcept;
+void operator delete(void* v, size_t, std::align_val_t) noexcept;
+void operator delete[](void* v, std::align_val_t) noexcept;
+void operator delete[](void* v, size_t, std::align_val_t) noexcept;
+#endif
@@ -0,0 +1,101 @@
+#pragma once
+
+// std::pmr and STL allocator adapters of the heap, to use it (or a bump
+// arena) for some containers only. They are separate from heap.hpp, since
+// <memory_resource> pulls in <new>, which can't be included in heap.cpp.
+
+#include <memory_resource>
+#include "heap.hpp"
+
+// Memory resource of my_malloc()/my_free(); deallocation uses the size
+class HeapResource : public std::pmr::memory_resource
+{
+private:
+    void* do_allocate(size_t size, size_t align) override
+    {
+        auto addr = my_malloc(size, align);
+        if(!addr)
+            throw std::bad_alloc();
+        return addr;
+    }
+
+    void do_deallocate(void* addr, size_t size, size_t) override
+    {
+        my_free_sized(addr, size);
+    }
+
+    bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override
+    {
+        return dynamic_cast<HeapResource const*>(&other);
+    }
+};
+
+// Shared instance, like std::pmr::new_delete_resource()
+inline HeapResource* heap_resource()
+{
+    static HeapResource resource;
+    return &resource;
+}
+
+// STL allocator of my_malloc()/my_free(), for containers that should use
+// the heap when operator new is not replaced (HEAP_NO_GLOBAL_OPERATORS)
+template<class T>
+struct HeapAllocator
+{
+    using value_type = T;
+
+    HeapAllocator() = default;
+    template<class U>
+    HeapAllocator(HeapAllocator<U> const&) noexcept {}
+
+    T* allocate(size_t count)
+    {
+        size_t size;
+        if(__builtin_mul_overflow(count, sizeof(T), &size))
+            throw std::bad_array_new_length();
+        auto addr = static_cast<T*>(my_malloc(size, alignof(T)));
+        if(!addr)
+            throw std::bad_alloc();
+        return addr;
+    }
+
+    void deallocate(T* addr, size_t count) noexcept
+    {
+        my_free_sized(addr, count * sizeof(T));
+    }
+
+    template<class U>
+    bool operator==(HeapAllocator<U> const&) const noexcept { return true; }
+    template<class U>
+    bool operator!=(HeapAllocator<U> const&) const noexcept { return false; }
+};
+
+// Memory resource of a BumpArena: deallocation does nothing, the memory is
+// given back when the arena is released
+class BumpArenaResource : public std::pmr::memory_resource
+{
+public:
+    explicit BumpArenaResource(BumpArena& arena)
+    : m_arena(arena)
+    {
+    }
+
+private:
+    void* do_allocate(size_t size, size_t align) override
+    {
+        auto addr = m_arena.alloc(size, align);
+        if(!addr)
+            throw std::bad_alloc();
+        return addr;
+    }
+
+    void do_deallocate(void*, size_t, size_t) override {}
+
+    bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override
+    {
+        auto resource = dynamic_cast<BumpArenaResource const*>(&other);
+        return resource && &resource->m_arena == &m_arena;
+    }
+
+    BumpArena& m_arena;
+};
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <vector>
 #include "heap.hpp"
+#include "heap_pmr.hpp"
 
 int main()
 {
@@ -40,6 +41,48 @@ int main()
     std::cout << "testbig=" << *testbig << std::endl;
     my_free(testbig);
 
+    // realloc (in place, if there is free space after it)
+    int* testrealloc = (int*)my_malloc(2000);
+    *testrealloc = 1234;
+    int* testrealloc2 = (int*)my_realloc(testrealloc, 3000);
+    std::cout << "realloc: " << *testrealloc2 << (testrealloc == testrealloc2 ? " (in place)" : " (moved)") << std::endl;
+    my_free(testrealloc2);
+
+    // calloc
+    int* testcalloc = (int*)my_calloc(100, sizeof(int));
+    std::cout << "calloc: " << testcalloc[0] << testcalloc[99] << std::endl;
+    my_free(testcalloc);
+
+    // aligned allocations (in a heap block and a big block)
+    void* testalign = my_malloc(100, 64);
+    void* testalign2 = my_malloc(100000, 4096);
+    std::cout << "align: " << ((size_t)testalign % 64) << ", " << ((size_t)testalign2 % 4096) << std::endl;
+    my_free(testalign);
+    my_free(testalign2);
+    struct alignas(128) Aligned { char data[200]; };
+    auto testalignnew = new Aligned;
+    std::cout << "align new: " << ((size_t)testalignnew % 128) << std::endl;
+    delete testalignnew;
+
+    // bump arena, also with std::pmr containers
+    {
+        BumpArena arena;
+        auto testbump = (int*)arena.alloc(sizeof(int));
+        *testbump = 42;
+        BumpArenaResource resource(arena);
+        std::pmr::vector<int> testpmr(&resource);
+        for(int i = 0; i < 10000; i++)
+            testpmr.push_back(i);
+        std::cout << "bump: " << *testbump << ", " << testpmr[9999] << std::endl;
+    }
+
+    // containers using the heap through an allocator or a memory resource
+    {
+        std::vector<int, HeapAllocator<int>> testallocator(1000, 7);
+        std::pmr::vector<int> testresource(1000, 8, heap_resource());
+        std::cout << "allocators: " << testallocator[999] << ", " << testresource[999] << std::endl;
+    }
+
     // Some real example
     std::cout << "----TEST----" << std::endl;
     {
@@ -56,11 +99,17 @@ int main()
     }
     std::cout << "----TEST END----" << std::endl;
 
-    // Double-free at end :)
-    // (This will probably not crash because this block is reused)
+    auto stats = my_heap_stats();
+    std::cout << "stats: " << stats.bytes_in_use << " bytes in use, " << stats.heap_blocks << " heap blocks, "
+        << stats.slabs << " slabs, fragmentation " << stats.fragmentation << std::endl;
+
     std::cout << "End Main" << std::endl;
     my_heap_dump();
-    my_free(test1);
     my_leak_check();
+
+    // Double-free at end :)
+    // (This aborts: test1 is kept in a size class free list, so it is not reused)
+    fflush(stdout);
+    my_free(test1);
     return 0;
 }
@@ -0,0 +1,211 @@
+#include <chrono>
+#include <unordered_map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "heap.hpp"
+
+// Replays an allocation trace written by my_heap_trace_start() against this
+// heap (or glibc malloc with --glibc), as fast as possible and in a single
+// thread, then prints the throughput and the memory footprint. The heap
+// can use another placement policy than first-fit with --placement.
+//
+// Usage: heap_replay <trace> [--glibc] [--placement first|next|best]
+
+// Keeps the bookkeeping of the replay out of the replayed heap
+template<class T>
+struct MallocAllocator
+{
+    using value_type = T;
+
+    MallocAllocator() = default;
+    template<class U>
+    MallocAllocator(MallocAllocator<U> const&) {}
+
+    T* allocate(size_t count) { return static_cast<T*>(malloc(count * sizeof(T))); }
+    void deallocate(T* addr, size_t) { free(addr); }
+
+    bool operator==(MallocAllocator const&) const { return true; }
+    bool operator!=(MallocAllocator const&) const { return false; }
+};
+
+// Recorded address -> replayed allocation
+using AddressMap = std::unordered_map<uint64_t, void*, std::hash<uint64_t>, std::equal_to<uint64_t>,
+    MallocAllocator<std::pair<uint64_t const, void*>>>;
+
+struct Replayer
+{
+    bool glibc;
+    AddressMap live;
+    AddressMap reallocating; // Index of a Realloc record -> its result
+    size_t unmatched = 0;    // Frees of allocations made before the trace started
+
+    void* take(uint64_t addr)
+    {
+        auto it = live.find(addr);
+        if(it == live.end())
+        {
+            unmatched++;
+            return nullptr;
+        }
+        auto result = it->second;
+        live.erase(it);
+        return result;
+    }
+
+    void replay(HeapTraceRecord const& record, uint64_t index)
+    {
+        switch(record.op)
+        {
+            case HeapTraceRecord::Malloc:
+            case HeapTraceRecord::Calloc:
+            {
+                if(!record.addr)
+                    return;
+                void* addr;
+                if(record.op == HeapTraceRecord::Calloc)
+                    addr = glibc ? calloc(1, record.size) : my_calloc(1, record.size);
+                else if(glibc)
+                    addr = record.align > 16 ? aligned_alloc(record.align, (record.size + record.align - 1) & ~(size_t)(record.align - 1)) : malloc(record.size);
+                else
+                    addr = my_malloc(record.size, record.align);
+                // Touch it, like the program would
+                if(addr && record.size)
+                    *(char*)addr = 1;
+                live[record.addr] = addr;
+                return;
+            }
+            case HeapTraceRecord::Free:
+            {
+                auto addr = take(record.addr);
+                glibc ? free(addr) : my_free(addr);
+                return;
+            }
+            case HeapTraceRecord::Realloc:
+            {
+                auto addr = record.old_addr ? take(record.old_addr) : nullptr;
+                auto new_addr = glibc ? realloc(addr, record.size) : my_realloc(addr, record.size);
+                if(new_addr)
+                    reallocating[index] = new_addr;
+                return;
+            }
+            case HeapTraceRecord::ReallocResult:
+            {
+                auto it = reallocating.find(record.old_addr);
+                if(it == reallocating.end())
+                    return;
+                live[record.addr] = it->second;
+                reallocating.erase(it);
+                return;
+            }
+        }
+        printf("heap_replay: Invalid operation %u\n", record.op);
+        exit(1);
+    }
+};
+
+int main(int argc, char** argv)
+{
+    if(argc < 2)
+    {
+        printf("Usage: %s <trace> [--glibc] [--placement first|next|best]\n", argv[0]);
+        return 1;
+    }
+    bool glibc = false;
+    for(int i = 2; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--glibc") == 0)
+            glibc = true;
+        else if(strcmp(argv[i], "--placement") == 0 && i + 1 < argc)
+        {
+            auto name = argv[++i];
+            if(strcmp(name, "first") == 0)
+                my_heap_set_placement(HeapPlacement::FirstFit);
+            else if(strcmp(name, "next") == 0)
+                my_heap_set_placement(HeapPlacement::NextFit);
+            else if(strcmp(name, "best") == 0)
+                my_heap_set_placement(HeapPlacement::BestFit);
+            else
+            {
+                printf("heap_replay: Unknown placement %s\n", name);
+                return 1;
+            }
+        }
+        else
+        {
+            printf("heap_replay: Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    auto file = fopen(argv[1], "rb");
+    if(!file)
+    {
+        perror("heap_replay: fopen");
+        return 1;
+    }
+    HeapTraceHeader header;
+    if(fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, heap_trace_magic, sizeof(header.magic))
+        || header.version != heap_trace_version || header.record_size != sizeof(HeapTraceRecord))
+    {
+        printf("heap_replay: %s is not a trace of this version\n", argv[1]);
+        return 1;
+    }
+
+    // Read it all first, so that reading isn't measured
+    size_t capacity = 1 << 16, count = 0;
+    auto records = (HeapTraceRecord*)malloc(capacity * sizeof(HeapTraceRecord));
+    while(true)
+    {
+        if(count == capacity)
+        {
+            capacity *= 2;
+            records = (HeapTraceRecord*)realloc(records, capacity * sizeof(HeapTraceRecord));
+        }
+        auto read = fread(records + count, sizeof(HeapTraceRecord), capacity - count, file);
+        if(!read)
+            break;
+        count += read;
+    }
+    fclose(file);
+
+    Replayer replayer { glibc };
+    size_t peak_mapped = 0, peak_in_use = 0;
+    double peak_fragmentation = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < count; i++)
+    {
+        replayer.replay(records[i], i);
+        // Stats are cheap, but not free
+        if(!glibc && i % 1024 == 0)
+        {
+            auto stats = my_heap_stats();
+            if(stats.bytes_mapped > peak_mapped)
+            {
+                peak_mapped = stats.bytes_mapped;
+                peak_fragmentation = stats.fragmentation;
+            }
+            peak_in_use = std::max(peak_in_use, stats.bytes_in_use);
+        }
+    }
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%zu operations (%s) in %.3f s, %.0f ops/s\n", count, glibc ? "glibc" : "heap", seconds, count / seconds);
+    if(count)
+        printf("traced time: %.3f s\n", records[count - 1].time_ns / 1e9);
+    printf("max RSS: %ld KiB\n", usage.ru_maxrss);
+    if(!glibc)
+    {
+        auto stats = my_heap_stats();
+        printf("peak mapped: %zu bytes (fragmentation %.3f), peak in use: %zu bytes\n", peak_mapped, peak_fragmentation, peak_in_use);
+        printf("at the end: %zu bytes mapped, %zu in use, fragmentation %.3f\n", stats.bytes_mapped, stats.bytes_in_use, stats.fragmentation);
+        printf("free regions of heap blocks: %zu bytes in %zu\n", stats.free_bytes, stats.free_regions);
+    }
+    if(replayer.unmatched)
+        printf("%zu frees of allocations made before the trace\n", replayer.unmatched);
+    free(records);
+    return 0;
+}